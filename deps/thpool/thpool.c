@@ -8,6 +8,10 @@
  * 
  ********************************/
 
+/* pthread_attr_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <unistd.h>
 #include <signal.h>
@@ -16,6 +20,14 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h> 
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "thpool.h"
 
@@ -25,8 +37,21 @@
 #define THPOOL_DEBUG 0
 #endif
 
-#define MAX_NANOSEC 999999999
-#define CEIL(X) ((X-(int)(X)) > 0 ? (int)(X+1) : (int)(X))
+/* Slots in the job ring, must be a power of two */
+#define JOBQUEUE_SIZE 4096
+
+/* Polls of the semaphore before an idle thread goes to sleep */
+#define CSEM_SPIN 2000
+
+/* thpool_wait spins through a window this long (ns) around the predicted
+ * end of a batch and sleeps on the futex outside of it */
+#define FBARRIER_SPIN_NS 50000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
 
 static volatile int threads_keepalive;
 static volatile int threads_on_hold;
@@ -38,35 +63,59 @@ static volatile int threads_on_hold;
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
+/* Counting semaphore, a futex on linux and a mutex/condvar elsewhere */
+typedef struct csem {
+	int v;                               /* posts not yet consumed    */
+	int waiters;                         /* threads asleep in wait    */
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t   cond;
+#endif
+} csem;
+
+
+/* Frame barrier, counts jobs added and not yet finished. The last job
+ * to finish wakes whoever sleeps in thpool_wait */
+typedef struct fbarrier {
+	int  pending;                        /* unfinished jobs           */
+	int  waiters;                        /* threads asleep in wait    */
+	long predict;                        /* moving average of waits (ns) */
+#ifndef __linux__
 	pthread_mutex_t mutex;
 	pthread_cond_t   cond;
-	int v;
-} bsem;
+#endif
+} fbarrier;
 
 
-/* Job */
+/* Job, one slot of the job ring. Jobs live inline in the ring so adding
+ * work never allocates */
 typedef struct job{
-	struct job*  prev;                   /* pointer to previous job   */
+	size_t sequence;                     /* ring position it is ready for */
 	void*  (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
 } job;
 
 
-/* Job queue */
+/* Job queue, bounded lock-free MPMC ring (Dmitry Vyukov's design). Both
+ * ends are claimed with a single CAS, producers and consumers never share
+ * a lock */
 typedef struct jobqueue{
-	pthread_mutex_t rwmutex;             /* used for queue r/w access */
-	job  *front;                         /* pointer to front of queue */
-	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	job   *jobs;                         /* JOBQUEUE_SIZE slots       */
+	size_t mask;
+	char   pad0[64];
+	size_t enqueue_pos;                  /* next slot to fill         */
+	char   pad1[64 - sizeof(size_t)];
+	size_t dequeue_pos;                  /* next slot to run          */
+	char   pad2[64 - sizeof(size_t)];
+	csem  *has_jobs;                     /* one post per queued job   */
+	int    len;                          /* number of jobs in queue   */
 } jobqueue;
 
 
 /* Thread */
 typedef struct thread{
 	int       id;                        /* friendly id               */
+	int       cpu;                       /* cpu it is pinned to or -1 */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
 } thread;
@@ -76,9 +125,9 @@ typedef struct thread{
 typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
 	volatile int num_threads_alive;      /* threads currently alive   */
-	volatile int num_threads_working;    /* threads currently working */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	jobqueue*  jobqueue_p;               /* pointer to the job queue  */    
+	fbarrier   barrier;                  /* released when all jobs ran */
 } thpool_;
 
 
@@ -88,22 +137,30 @@ typedef struct thpool_{
 /* ========================== PROTOTYPES ============================ */
 
 
-static void  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
+static void  thread_init(thpool_* thpool_p, struct thread** thread_p, int id, int cpu);
 static void* thread_do(struct thread* thread_p);
 static void  thread_hold();
 static void  thread_destroy(struct thread* thread_p);
+static void  job_run(thpool_* thpool_p);
 
 static int   jobqueue_init(thpool_* thpool_p);
 static void  jobqueue_clear(thpool_* thpool_p);
-static void  jobqueue_push(thpool_* thpool_p, struct job* newjob_p);
-static struct job* jobqueue_pull(thpool_* thpool_p);
+static int   jobqueue_push(thpool_* thpool_p, void* (*function_p)(void*), void* arg_p);
+static int   jobqueue_pull(thpool_* thpool_p, struct job* job_p);
 static void  jobqueue_destroy(thpool_* thpool_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static void  csem_init(struct csem *csem_p);
+static void  csem_destroy(struct csem *csem_p);
+static void  csem_post(struct csem *csem_p);
+static void  csem_post_all(struct csem *csem_p, int n);
+static void  csem_wait(struct csem *csem_p);
+static int   csem_trywait(struct csem *csem_p);
+
+static void  fbarrier_init(struct fbarrier *fbarrier_p);
+static void  fbarrier_destroy(struct fbarrier *fbarrier_p);
+static void  fbarrier_add(struct fbarrier *fbarrier_p);
+static void  fbarrier_done(struct fbarrier *fbarrier_p);
+static void  fbarrier_wait(struct fbarrier *fbarrier_p);
 
 
 
@@ -114,6 +171,12 @@ static void  bsem_wait(struct bsem *bsem_p);
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	return thpool_init_affinity(num_threads, NULL);
+}
+
+
+/* Initialise thread pool, thread n is pinned to cpus[n] */
+struct thpool_* thpool_init_affinity(int num_threads, const int* cpus){
 
 	threads_on_hold   = 0;
 	threads_keepalive = 1;
@@ -130,7 +193,7 @@ struct thpool_* thpool_init(int num_threads){
 		return NULL;
 	}
 	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
+	fbarrier_init(&thpool_p->barrier);
 
 	/* Initialise the job queue */
 	if (jobqueue_init(thpool_p) == -1){
@@ -154,7 +217,7 @@ struct thpool_* thpool_init(int num_threads){
 	/* Thread init */
 	int n;
 	for (n=0; n<num_threads; n++){
-		thread_init(thpool_p, &thpool_p->threads[n], n);
+		thread_init(thpool_p, &thpool_p->threads[n], n, cpus ? cpus[n] : -1);
 		if (THPOOL_DEBUG)
 			printf("THPOOL_DEBUG: Created thread %d in pool \n", n);
 	}
@@ -168,22 +231,20 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p){
-	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
-	if (newjob==NULL){
-		fprintf(stderr, "thpool_add_work(): Could not allocate memory for new job\n");
-		return -1;
-	}
+	/* counted before it is visible, a waiter can never see the batch
+	 * drained while this job is still queued */
+	fbarrier_add(&thpool_p->barrier);
 
-	/* add function and argument */
-	newjob->function=function_p;
-	newjob->arg=arg_p;
-
-	/* add job to queue */
-	pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-	jobqueue_push(thpool_p, newjob);
-	pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
+	/* help drain a full ring, jobs adding work may run on the only
+	 * thread that could make room */
+	while (jobqueue_push(thpool_p, function_p, arg_p) == -1){
+		if (!csem_trywait(thpool_p->jobqueue_p->has_jobs)){
+			sched_yield();
+			continue;
+		}
+		job_run(thpool_p);
+	}
 
 	return 0;
 }
@@ -191,46 +252,7 @@ int thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p){
 
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
-
-	/* Continuous polling */
-	double timeout = 1.0;
-	time_t start, end;
-	double tpassed = 0.0;
-	time (&start);
-	while (tpassed < timeout && 
-			(thpool_p->jobqueue_p->len || thpool_p->num_threads_working))
-	{
-		time (&end);
-		tpassed = difftime(end,start);
-	}
-
-	/* Exponential polling */
-	long init_nano =  1; /* MUST be above 0 */
-	long new_nano;
-	double multiplier =  1.01;
-	int  max_secs   = 20;
-	
-	struct timespec polling_interval;
-	polling_interval.tv_sec  = 0;
-	polling_interval.tv_nsec = init_nano;
-	
-	while (thpool_p->jobqueue_p->len || thpool_p->num_threads_working)
-	{
-		nanosleep(&polling_interval, NULL);
-		if ( polling_interval.tv_sec < max_secs ){
-			new_nano = CEIL(polling_interval.tv_nsec * multiplier);
-			polling_interval.tv_nsec = new_nano % MAX_NANOSEC;
-			if ( new_nano > MAX_NANOSEC ) {
-				polling_interval.tv_sec ++;
-			}
-		}
-		else break;
-	}
-	
-	/* Fall back to max polling */
-	while (thpool_p->jobqueue_p->len || thpool_p->num_threads_working){
-		sleep(max_secs);
-	}
+	fbarrier_wait(&thpool_p->barrier);
 }
 
 
@@ -248,20 +270,21 @@ void thpool_destroy(thpool_* thpool_p){
 	double tpassed = 0.0;
 	time (&start);
 	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
+		csem_post_all(thpool_p->jobqueue_p->has_jobs, threads_total);
 		time (&end);
 		tpassed = difftime(end,start);
 	}
 	
 	/* Poll remaining threads */
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
+		csem_post_all(thpool_p->jobqueue_p->has_jobs, threads_total);
 		sleep(1);
 	}
 
 	/* Job queue cleanup */
 	jobqueue_destroy(thpool_p);
 	free(thpool_p->jobqueue_p);
+	fbarrier_destroy(&thpool_p->barrier);
 	
 	/* Deallocs */
 	int n;
@@ -298,9 +321,10 @@ void thpool_resume(thpool_* thpool_p) {
  * 
  * @param thread        address to the pointer of the thread to be created
  * @param id            id to be given to the thread
+ * @param cpu           cpu to pin the thread to, -1 lets it float
  * 
  */
-static void thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+static void thread_init (thpool_* thpool_p, struct thread** thread_p, int id, int cpu){
 	
 	*thread_p = (struct thread*)malloc(sizeof(struct thread));
 	if (thread_p == NULL){
@@ -310,13 +334,49 @@ static void thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
 
 	(*thread_p)->thpool_p = thpool_p;
 	(*thread_p)->id       = id;
+	(*thread_p)->cpu      = cpu;
+
+	/* Pinned before it starts, so its stack and everything it touches
+	 * first is allocated near that cpu */
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+#ifdef __linux__
+	if (cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set)){
+			fprintf(stderr, "thread_init(): Could not pin thread %d to cpu %d\n", id, cpu);
+		}
+	}
+#endif
 
-	pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
+	if (pthread_create(&(*thread_p)->pthread, &attr, (void *)thread_do, (*thread_p))){
+		/* an invalid cpu fails the create, run unpinned instead */
+		pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
+	}
+	pthread_attr_destroy(&attr);
 	pthread_detach((*thread_p)->pthread);
 	
 }
 
 
+/* Read a job from the queue and execute it, the caller has already taken
+ * its post from has_jobs */
+static void job_run(thpool_* thpool_p){
+
+	/* Every post is backed by a job, a failed pull only means its producer
+	 * has claimed an earlier slot and not filled it yet */
+	job job_buff;
+	while (jobqueue_pull(thpool_p, &job_buff) == -1){
+		CPU_RELAX();
+	}
+	job_buff.function(job_buff.arg);
+
+	fbarrier_done(&thpool_p->barrier);
+}
+
+
 /* Sets the calling thread on hold */
 static void thread_hold () {
 	threads_on_hold = 1;
@@ -353,31 +413,11 @@ static void* thread_do(struct thread* thread_p){
 
 	while(threads_keepalive){
 
-		bsem_wait(thpool_p->jobqueue_p->has_jobs);
+		csem_wait(thpool_p->jobqueue_p->has_jobs);
 
 		if (threads_keepalive){
 			
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-			
-			/* Read job from queue and execute it */
-			void*(*func_buff)(void* arg);
-			void*  arg_buff;
-			job* job_p;
-			pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-			job_p = jobqueue_pull(thpool_p);
-			pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
-			
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			job_run(thpool_p);
 
 		}
 	}
@@ -409,16 +449,26 @@ static int jobqueue_init(thpool_* thpool_p){
 		return -1;
 	}
 	thpool_p->jobqueue_p->len = 0;
-	thpool_p->jobqueue_p->front = NULL;
-	thpool_p->jobqueue_p->rear  = NULL;
+	thpool_p->jobqueue_p->mask = JOBQUEUE_SIZE - 1;
+	thpool_p->jobqueue_p->enqueue_pos = 0;
+	thpool_p->jobqueue_p->dequeue_pos = 0;
+
+	thpool_p->jobqueue_p->jobs = (struct job*)malloc(JOBQUEUE_SIZE * sizeof(struct job));
+	if (thpool_p->jobqueue_p->jobs == NULL){
+		return -1;
+	}
 
-	thpool_p->jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
+	size_t n;
+	for (n=0; n<JOBQUEUE_SIZE; n++){
+		thpool_p->jobqueue_p->jobs[n].sequence = n;
+	}
+
+	thpool_p->jobqueue_p->has_jobs = (struct csem*)malloc(sizeof(struct csem));
 	if (thpool_p->jobqueue_p->has_jobs == NULL){
 		return -1;
 	}
 
-	pthread_mutex_init(&(thpool_p->jobqueue_p->rwmutex), NULL);
-	bsem_init(thpool_p->jobqueue_p->has_jobs, 0);
+	csem_init(thpool_p->jobqueue_p->has_jobs);
 
 	return 0;
 }
@@ -427,80 +477,93 @@ static int jobqueue_init(thpool_* thpool_p){
 /* Clear the queue */
 static void jobqueue_clear(thpool_* thpool_p){
 
-	while(thpool_p->jobqueue_p->len){
-		free(jobqueue_pull(thpool_p));
-	}
+	job job_buff;
+	while(jobqueue_pull(thpool_p, &job_buff) == 0){}
 
-	thpool_p->jobqueue_p->front = NULL;
-	thpool_p->jobqueue_p->rear  = NULL;
-	bsem_reset(thpool_p->jobqueue_p->has_jobs);
+	thpool_p->jobqueue_p->has_jobs->v = 0;
 	thpool_p->jobqueue_p->len = 0;
 
 }
 
 
-/* Add (allocated) job to queue
- *
- * Notice: Caller MUST hold a mutex
- */
-static void jobqueue_push(thpool_* thpool_p, struct job* newjob){
+/* Add a job to the queue, returns -1 when the ring is full */
+static int jobqueue_push(thpool_* thpool_p, void* (*function_p)(void*), void* arg_p){
 
-	newjob->prev = NULL;
+	jobqueue* queue_p = thpool_p->jobqueue_p;
+	size_t pos = __atomic_load_n(&queue_p->enqueue_pos, __ATOMIC_RELAXED);
+	job* cell;
 
-	switch(thpool_p->jobqueue_p->len){
+	for (;;){
+		cell = &queue_p->jobs[pos & queue_p->mask];
+		size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
 
-		case 0:  /* if no jobs in queue */
-					thpool_p->jobqueue_p->front = newjob;
-					thpool_p->jobqueue_p->rear  = newjob;
-					break;
-
-		default: /* if jobs in queue */
-					thpool_p->jobqueue_p->rear->prev = newjob;
-					thpool_p->jobqueue_p->rear = newjob;
-					
+		if (dif == 0){
+			/* slot is free, claim it */
+			if (__atomic_compare_exchange_n(&queue_p->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if (dif < 0){
+			/* slot still holds a job from the previous lap */
+			return -1;
+		}
+		else {
+			pos = __atomic_load_n(&queue_p->enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	thpool_p->jobqueue_p->len++;
-	
-	bsem_post(thpool_p->jobqueue_p->has_jobs);
+
+	cell->function = function_p;
+	cell->arg = arg_p;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&queue_p->len, 1, __ATOMIC_SEQ_CST);
+	csem_post(queue_p->has_jobs);
+	return 0;
 }
 
 
-/* Get first job from queue(removes it from queue)
- * 
- * Notice: Caller MUST hold a mutex
- */
-static struct job* jobqueue_pull(thpool_* thpool_p){
-
-	job* job_p;
-	job_p = thpool_p->jobqueue_p->front;
-
-	switch(thpool_p->jobqueue_p->len){
-		
-		case 0:  /* if no jobs in queue */
-		  			break;
-		
-		case 1:  /* if one job in queue */
-					thpool_p->jobqueue_p->front = NULL;
-					thpool_p->jobqueue_p->rear  = NULL;
-					thpool_p->jobqueue_p->len = 0;
-					break;
-		
-		default: /* if >1 jobs in queue */
-					thpool_p->jobqueue_p->front = job_p->prev;
-					thpool_p->jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(thpool_p->jobqueue_p->has_jobs);
-					
+/* Take the oldest job off the queue, returns -1 when there is none */
+static int jobqueue_pull(thpool_* thpool_p, struct job* job_p){
+
+	jobqueue* queue_p = thpool_p->jobqueue_p;
+	size_t pos = __atomic_load_n(&queue_p->dequeue_pos, __ATOMIC_RELAXED);
+	job* cell;
+
+	for (;;){
+		cell = &queue_p->jobs[pos & queue_p->mask];
+		size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif == 0){
+			if (__atomic_compare_exchange_n(&queue_p->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if (dif < 0){
+			return -1;
+		}
+		else {
+			pos = __atomic_load_n(&queue_p->dequeue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	
-	return job_p;
+
+	job_p->function = cell->function;
+	job_p->arg = cell->arg;
+	/* hand the slot back to producers one lap ahead */
+	__atomic_store_n(&cell->sequence, pos + queue_p->mask + 1, __ATOMIC_RELEASE);
+
+	__atomic_fetch_sub(&queue_p->len, 1, __ATOMIC_SEQ_CST);
+	return 0;
 }
 
 
 /* Free all queue resources back to the system */
 static void jobqueue_destroy(thpool_* thpool_p){
 	jobqueue_clear(thpool_p);
+	csem_destroy(thpool_p->jobqueue_p->has_jobs);
 	free(thpool_p->jobqueue_p->has_jobs);
+	free(thpool_p->jobqueue_p->jobs);
 }
 
 
@@ -510,48 +573,237 @@ static void jobqueue_destroy(thpool_* thpool_p){
 /* ======================== SYNCHRONISATION ========================= */
 
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		fprintf(stderr, "bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
-	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+#ifdef __linux__
+/* `timeout` is relative, NULL sleeps until woken */
+static void futex_wait(int* addr, int value, const struct timespec* timeout){
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int* addr, int count){
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
+
+/* Init semaphore to 0 */
+static void csem_init(csem *csem_p) {
+	csem_p->v = 0;
+	csem_p->waiters = 0;
+#ifndef __linux__
+	pthread_mutex_init(&(csem_p->mutex), NULL);
+	pthread_cond_init(&(csem_p->cond), NULL);
+#endif
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
+static void csem_destroy(csem *csem_p) {
+#ifndef __linux__
+	pthread_mutex_destroy(&(csem_p->mutex));
+	pthread_cond_destroy(&(csem_p->cond));
+#endif
 }
 
 
 /* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+static void csem_post(csem *csem_p) {
+#ifdef __linux__
+	__atomic_fetch_add(&csem_p->v, 1, __ATOMIC_SEQ_CST);
+	/* no syscall while every thread is busy or spinning */
+	if (__atomic_load_n(&csem_p->waiters, __ATOMIC_SEQ_CST)){
+		futex_wake(&csem_p->v, 1);
+	}
+#else
+	pthread_mutex_lock(&csem_p->mutex);
+	__atomic_fetch_add(&csem_p->v, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&csem_p->cond);
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
+}
+
+
+/* Post `n` times, waking up to `n` threads */
+static void csem_post_all(csem *csem_p, int n) {
+#ifdef __linux__
+	__atomic_fetch_add(&csem_p->v, n, __ATOMIC_SEQ_CST);
+	futex_wake(&csem_p->v, n);
+#else
+	pthread_mutex_lock(&csem_p->mutex);
+	__atomic_fetch_add(&csem_p->v, n, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&csem_p->cond);
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
+}
+
+
+/* Try to take a post without blocking */
+static int csem_trywait(csem *csem_p) {
+	int v = __atomic_load_n(&csem_p->v, __ATOMIC_RELAXED);
+	while (v > 0){
+		if (__atomic_compare_exchange_n(&csem_p->v, &v, v - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Wait until a post is available and take it. Spins for a while first,
+ * a thread that just finished a job usually finds the next one there */
+static void csem_wait(csem* csem_p) {
+	int n;
+	for (n=0; n<CSEM_SPIN; n++){
+		if (csem_trywait(csem_p)){
+			return;
+		}
+		CPU_RELAX();
+	}
+
+#ifdef __linux__
+	while (!csem_trywait(csem_p)){
+		__atomic_fetch_add(&csem_p->waiters, 1, __ATOMIC_SEQ_CST);
+		/* returns right away if a post landed since the check */
+		futex_wait(&csem_p->v, 0, NULL);
+		__atomic_fetch_sub(&csem_p->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+#else
+	/* posts are counted atomically so the spin above can take them
+	 * without the mutex */
+	pthread_mutex_lock(&csem_p->mutex);
+	while (!csem_trywait(csem_p)) {
+		pthread_cond_wait(&csem_p->cond, &csem_p->mutex);
+	}
+	pthread_mutex_unlock(&csem_p->mutex);
+#endif
+}
+
+
+
+
+/* Monotonic clock in nanoseconds */
+static long fbarrier_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+static void fbarrier_init(fbarrier *fbarrier_p) {
+	fbarrier_p->pending = 0;
+	fbarrier_p->waiters = 0;
+	fbarrier_p->predict = 0;
+#ifndef __linux__
+	pthread_mutex_init(&(fbarrier_p->mutex), NULL);
+	pthread_cond_init(&(fbarrier_p->cond), NULL);
+#endif
+}
+
+
+static void fbarrier_destroy(fbarrier *fbarrier_p) {
+#ifndef __linux__
+	pthread_mutex_destroy(&(fbarrier_p->mutex));
+	pthread_cond_destroy(&(fbarrier_p->cond));
+#endif
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+static void fbarrier_add(fbarrier *fbarrier_p) {
+	__atomic_fetch_add(&fbarrier_p->pending, 1, __ATOMIC_SEQ_CST);
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Finish one job, the last one releases the waiters */
+static void fbarrier_done(fbarrier *fbarrier_p) {
+	if (__atomic_sub_fetch(&fbarrier_p->pending, 1, __ATOMIC_SEQ_CST)){
+		return;
+	}
+	/* no syscall unless someone went to sleep */
+	if (!__atomic_load_n(&fbarrier_p->waiters, __ATOMIC_SEQ_CST)){
+		return;
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+#ifdef __linux__
+	futex_wake(&fbarrier_p->pending, INT_MAX);
+#else
+	pthread_mutex_lock(&fbarrier_p->mutex);
+	pthread_cond_broadcast(&fbarrier_p->cond);
+	pthread_mutex_unlock(&fbarrier_p->mutex);
+#endif
+}
+
+
+/* Sleep until all jobs are done, or `timeout` ns have passed when it is
+ * above 0 */
+static void fbarrier_sleep(fbarrier *fbarrier_p, long timeout) {
+#ifdef __linux__
+	long deadline = fbarrier_now() + timeout;
+	int pending;
+	while ((pending = __atomic_load_n(&fbarrier_p->pending, __ATOMIC_SEQ_CST))){
+		struct timespec rel;
+		if (timeout > 0){
+			long left = deadline - fbarrier_now();
+			if (left <= 0){
+				return;
+			}
+			rel.tv_sec  = left / 1000000000L;
+			rel.tv_nsec = left % 1000000000L;
+		}
+		__atomic_fetch_add(&fbarrier_p->waiters, 1, __ATOMIC_SEQ_CST);
+		/* returns right away whenever `pending` moved since the load */
+		futex_wait(&fbarrier_p->pending, pending, timeout > 0 ? &rel : NULL);
+		__atomic_fetch_sub(&fbarrier_p->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+#else
+	struct timespec abs;
+	if (timeout > 0){
+		clock_gettime(CLOCK_REALTIME, &abs);
+		abs.tv_sec  += (abs.tv_nsec + timeout) / 1000000000L;
+		abs.tv_nsec  = (abs.tv_nsec + timeout) % 1000000000L;
+	}
+	pthread_mutex_lock(&fbarrier_p->mutex);
+	__atomic_fetch_add(&fbarrier_p->waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&fbarrier_p->pending, __ATOMIC_SEQ_CST)){
+		if (timeout <= 0){
+			pthread_cond_wait(&fbarrier_p->cond, &fbarrier_p->mutex);
+		}
+		else if (pthread_cond_timedwait(&fbarrier_p->cond, &fbarrier_p->mutex, &abs) == ETIMEDOUT){
+			break;
+		}
+	}
+	__atomic_fetch_sub(&fbarrier_p->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&fbarrier_p->mutex);
+#endif
+}
+
+
+/* Wait until every job added so far has finished.
+ *
+ * Batches (frames) tend to take about as long as the previous ones, so the
+ * caller sleeps through most of the predicted time, spins with the cpu
+ * relaxed through a short window around the predicted end, and only falls
+ * back to a plain futex sleep when the batch overruns. Both sleeps are
+ * woken by the last job, spinning only shaves off the wake up latency.
+ */
+static void fbarrier_wait(fbarrier *fbarrier_p) {
+	if (!__atomic_load_n(&fbarrier_p->pending, __ATOMIC_SEQ_CST)){
+		return;
+	}
+
+	long start = fbarrier_now();
+	if (fbarrier_p->predict > FBARRIER_SPIN_NS){
+		fbarrier_sleep(fbarrier_p, fbarrier_p->predict - FBARRIER_SPIN_NS);
+	}
+
+	/* checking the clock is far slower than a pause, only look at it
+	 * every so often */
+	long deadline = fbarrier_now() + 2 * FBARRIER_SPIN_NS;
+	int n = 0;
+	while (__atomic_load_n(&fbarrier_p->pending, __ATOMIC_ACQUIRE)){
+		if (!(++n & 63) && fbarrier_now() > deadline){
+			fbarrier_sleep(fbarrier_p, 0);
+			break;
+		}
+		CPU_RELAX();
+	}
+
+	/* only the thread calling thpool_wait updates the estimate */
+	fbarrier_p->predict += (fbarrier_now() - start - fbarrier_p->predict) / 4;
 }
@@ -37,6 +37,28 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief  Initialize threadpool with pinned threads
+ * 
+ * Same as thpool_init() but thread n only runs on cpu cpus[n]. A negative
+ * entry leaves that thread free to run anywhere, NULL pins none of them.
+ * Pinning is only supported on Linux and is ignored elsewhere.
+ * 
+ * @example
+ * 
+ *    ..
+ *    int cpus[] = { 0, 2, 4, 6 };           //one thread per physical core
+ *    threadpool thpool = thpool_init_affinity(4, cpus);
+ *    ..
+ * 
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  cpus          cpu of each thread, num_threads entries or NULL
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_affinity(int num_threads, const int* cpus);
+
+
 /**
  * @brief Add work to the job queue
  * 
@@ -46,6 +68,10 @@ threadpool thpool_init(int num_threads);
  * 
  * NOTICE: You have to cast both the function and argument to not get warnings.
  * 
+ * The queue is a fixed size lock-free ring, adding work never allocates
+ * or takes a lock. When the ring is full the caller runs queued jobs
+ * itself until there is room.
+ * 
  * @example
  * 
  *    void print_num(int num){
@@ -74,11 +100,12 @@ int thpool_add_work(threadpool, void *(*function_p)(void*), void* arg_p);
  * Once the queue is empty and all work has completed, the calling thread
  * (probably the main program) will continue.
  * 
- * Smart polling is used in wait. The polling is initially 0 - meaning that
- * there is virtually no polling at all. If after 1 seconds the threads
- * haven't finished, the polling interval starts growing exponentially 
- * untill it reaches max_secs seconds. Then it jumps down to a maximum polling
- * interval assuming that heavy processing is being used in the threadpool.
+ * Jobs are counted from thpool_add_work() until they return and the last
+ * one to finish wakes the waiter through a futex, so there is no polling.
+ * The wait is adaptive: it sleeps through most of the time previous waits
+ * took and spins briefly around the expected end, which releases the caller
+ * within microseconds of the last job when batches (frames) are regular.
+ * Only one thread should wait on a pool at a time.
  *
  * @example
  * 
@@ -5,7 +5,7 @@
 
   typedef vec3 aabb_packet[6];
 
-  vec3 two = {2.0f, 2.0f, 2.0f};
+  static const vec3 two = {2.0f, 2.0f, 2.0f};
   static inline vec3 aabb_center(aabb b) {
     return (b[0] + b[1]) / two;
   }
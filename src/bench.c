@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <thpool.h>
+
+#include "vec.h"
+#include "world.h"
+#include "render.h"
+#include "scene.h"
+#include "cpu.h"
+
+// headless benchmark: renders a fixed camera path into memory and prints
+// the timings as json on stdout
+//
+//   bench [--threads n] [--pin mode] [--main role] [--numa mode] [--frames n]
+//         [--warmup n] [--poses n] [--width w] [--height h] [--tile n]
+//         [--stride 3|4] [--isa level]
+//
+// threads, pinning, the main thread's role, numa placement and the kernel
+// variant are described in cpu.h
+
+static int bench_compare(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+// nearest rank percentile of a sorted array
+static double bench_percentile(const double *sorted, const int count, const double p) {
+  int i = (int)ceil(p / 100.0 * count) - 1;
+  i = i < 0 ? 0 : (i >= count ? count - 1 : i);
+  return sorted[i];
+}
+
+static int bench_arg(int argc, char **argv, const char *name, int fallback) {
+  for (int i=1; i<argc - 1; i++) {
+    if (!strcmp(argv[i], name)) {
+      return atoi(argv[i + 1]);
+    }
+  }
+  return fallback;
+}
+
+int main(int argc, char **argv) {
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+  _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+  cpu_config cpus;
+  cpu_config_parse(&cpus, argc, argv);
+  int threads = cpus.threads;
+  int frames = bench_arg(argc, argv, "--frames", 100);
+  int warmup = bench_arg(argc, argv, "--warmup", 5);
+  int poses = bench_arg(argc, argv, "--poses", 50);
+  int width = bench_arg(argc, argv, "--width", 800);
+  int height = bench_arg(argc, argv, "--height", 600);
+  int tile = bench_arg(argc, argv, "--tile", RENDER_TILE_SIZE);
+  int stride = bench_arg(argc, argv, "--stride", 4) == 3 ? 3 : 4;
+
+  frames = frames < 1 ? 1 : frames;
+  poses = poses < 1 ? 1 : poses;
+
+  uint8_t *data = (uint8_t *)mem_alloc((size_t)width * height * stride);
+  render_tiles tiles = render_tiles_create(threads, tile);
+  if (!data || !tiles) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  tiles->caller = cpus.main == CPU_MAIN_RENDER;
+  threadpool pool = cpu_pool_create(&cpus);
+
+  double build_start = render_time();
+  voxel_world world = scene_create(pool);
+  render_tiles_place(tiles, world, cpus.numa, cpus.nodes);
+  double build = render_time() - build_start;
+
+  mat4 projection, view;
+  mat4_perspective(projection, M_PI/4.0, (float)width/(float)height, 0.1, 1000.0);
+
+  render_view frame_view;
+  double *times = (double *)malloc(sizeof(double) * frames);
+  double *busy = (double *)calloc(threads, sizeof(double));
+  long long *rendered = (long long *)calloc(threads, sizeof(long long));
+  long long *stolen = (long long *)calloc(threads, sizeof(long long));
+  double total = 0.0;
+
+  for (int f=-warmup; f<frames; f++) {
+    int pose = (f < 0 ? f + warmup : f) % poses;
+    scene_orbit(view, pose, poses);
+    render_view_create(&frame_view, view, projection, width, height);
+
+    double start = render_time();
+    render_frame(pool, tiles, &frame_view, world, data, width, height, stride);
+    double elapsed = render_time() - start;
+
+    if (f < 0) {
+      continue;
+    }
+
+    times[f] = elapsed;
+    total += elapsed;
+
+    for (int i=0; i<threads; i++) {
+      busy[i] += tiles->workers[i].elapsed;
+      rendered[i] += tiles->workers[i].rendered;
+      stolen[i] += tiles->workers[i].stolen;
+    }
+  }
+
+  // fnv-1a of the last frame, changes whenever the output does
+  uint64_t checksum = 14695981039346656037ULL;
+  for (int i=0; i<width * height * stride; i++) {
+    checksum = (checksum ^ data[i]) * 1099511628211ULL;
+  }
+
+  qsort(times, frames, sizeof(double), bench_compare);
+
+  printf("{\n");
+  printf("  \"width\": %i,\n", width);
+  printf("  \"height\": %i,\n", height);
+  printf("  \"threads\": %i,\n", threads);
+  printf("  \"pin\": \"%s\",\n", cpu_pin_name(cpus.pin));
+  printf("  \"main\": \"%s\",\n", cpus.main == CPU_MAIN_RENDER ? "render" : "present");
+  printf("  \"numa\": \"%s\",\n", cpu_numa_name(cpus.numa));
+  printf("  \"isa\": \"%s\",\n", isa_name(cpus.isa));
+  printf("  \"tile\": %i,\n", tiles->size);
+  printf("  \"stride\": %i,\n", stride);
+  printf("  \"frames\": %i,\n", frames);
+  printf("  \"poses\": %i,\n", poses);
+  printf("  \"build_ms\": %.3f,\n", build * 1000.0);
+  printf("  \"mrays_per_second\": %.3f,\n", (double)width * height * frames / total / 1000000.0);
+  printf("  \"frame_ms\": {\n");
+  printf("    \"mean\": %.3f,\n", total / frames * 1000.0);
+  printf("    \"min\": %.3f,\n", times[0] * 1000.0);
+  printf("    \"p50\": %.3f,\n", bench_percentile(times, frames, 50) * 1000.0);
+  printf("    \"p90\": %.3f,\n", bench_percentile(times, frames, 90) * 1000.0);
+  printf("    \"p99\": %.3f,\n", bench_percentile(times, frames, 99) * 1000.0);
+  printf("    \"max\": %.3f\n", times[frames - 1] * 1000.0);
+  printf("  },\n");
+  printf("  \"thread_busy_ms\": [");
+  for (int i=0; i<threads; i++) {
+    printf("%s%.3f", i ? ", " : "", busy[i] * 1000.0);
+  }
+  printf("],\n");
+  printf("  \"thread_tiles\": [");
+  for (int i=0; i<threads; i++) {
+    printf("%s%lli", i ? ", " : "", rendered[i]);
+  }
+  printf("],\n");
+  printf("  \"thread_steals\": [");
+  for (int i=0; i<threads; i++) {
+    printf("%s%lli", i ? ", " : "", stolen[i]);
+  }
+  printf("],\n");
+  printf("  \"checksum\": \"%016llx\"\n", (unsigned long long)checksum);
+  printf("}\n");
+
+  if (pool) {
+    thpool_destroy(pool);
+  }
+  render_tiles_destroy(tiles);
+  free(times);
+  free(busy);
+  free(rendered);
+  free(stolen);
+  mem_free(data, (size_t)width * height * stride);
+  return 0;
+}
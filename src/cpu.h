@@ -0,0 +1,224 @@
+#ifndef __CPU__
+#define __CPU__
+  #include <stdio.h>
+  #include <stdlib.h>
+  #include <string.h>
+  #include <unistd.h>
+  #include <pthread.h>
+  #include <sched.h>
+  #include <thpool.h>
+  #include "numa.h"
+  #include "isa.h"
+
+  // worker count, core pinning and the main thread's role are picked at
+  // startup, flags win over the environment:
+  //
+  //   --threads n    VOXEL_THREADS  render threads, the main one included
+  //                                 when it renders (default: one per core)
+  //   --pin mode     VOXEL_PIN      none, cores (one thread per physical
+  //                                 core) or smt (siblings after the cores)
+  //   --main role    VOXEL_MAIN     render (works tiles like the others) or
+  //                                 present (hands out frames and waits)
+  //   --numa mode    VOXEL_NUMA     none, interleave or replicate, see
+  //                                 numa.h (default: replicate when pinned
+  //                                 on more than one node)
+  //   --isa level    VOXEL_ISA      baseline, sse4.2, avx2 or avx512, the
+  //                                 widest kernels to run, see isa.h
+  //                                 (default: the best the cpu supports)
+
+  #define CPU_MAX CPU_SETSIZE
+  #define CPU_MAX_THREADS 256
+
+  #define CPU_PIN_NONE 0
+  #define CPU_PIN_CORES 1
+  #define CPU_PIN_SMT 2
+
+  #define CPU_MAIN_PRESENT 0
+  #define CPU_MAIN_RENDER 1
+
+  typedef struct {
+    int threads;
+    int pin;
+    int main;
+    int numa;
+    // kernel variant every render thread runs
+    int isa;
+    // physical cores and hardware threads this process may run on
+    int cores, count;
+    // cpu and numa node of every render thread, -1 when it is not pinned.
+    // thread 0 is the main thread when it renders
+    int cpus[CPU_MAX_THREADS];
+    int nodes[CPU_MAX_THREADS];
+  } cpu_config;
+
+  static int cpu_read_int(const char *format, const int cpu, const int fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), format, cpu);
+
+    int value = fallback;
+    FILE *f = fopen(path, "r");
+    if (f) {
+      if (fscanf(f, "%i", &value) != 1) {
+        value = fallback;
+      }
+      fclose(f);
+    }
+    return value;
+  }
+
+  // fills `out` with the cpus in our affinity mask, the first hardware
+  // thread of every physical core before any of their smt siblings. returns
+  // the cpu count and stores the core count in `cores`
+  static int cpu_topology(int *out, int *cores) {
+    static int package[CPU_MAX], core[CPU_MAX], cpus[CPU_MAX];
+    cpu_set_t set;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+      CPU_ZERO(&set);
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+      for (long c=0; c<online && c<CPU_MAX; c++) {
+        CPU_SET(c, &set);
+      }
+    }
+
+    for (int c=0; c<CPU_MAX; c++) {
+      if (!CPU_ISSET(c, &set)) {
+        continue;
+      }
+      // without sysfs every cpu counts as its own core
+      package[count] = cpu_read_int("/sys/devices/system/cpu/cpu%i/topology/physical_package_id", c, 0);
+      core[count] = cpu_read_int("/sys/devices/system/cpu/cpu%i/topology/core_id", c, c);
+      cpus[count++] = c;
+    }
+
+    // a cpu is a sibling when an earlier one sits on the same core
+    static char sibling[CPU_MAX];
+    int primary = 0;
+    for (int i=0; i<count; i++) {
+      sibling[i] = 0;
+      for (int j=0; j<i && !sibling[i]; j++) {
+        sibling[i] = package[j] == package[i] && core[j] == core[i];
+      }
+
+      if (!sibling[i]) {
+        out[primary++] = cpus[i];
+      }
+    }
+
+    for (int i=0, n=primary; i<count; i++) {
+      if (sibling[i]) {
+        out[n++] = cpus[i];
+      }
+    }
+
+    *cores = primary;
+    return count;
+  }
+
+  static const char *cpu_option(int argc, char **argv, const char *flag, const char *env) {
+    for (int i=1; i<argc - 1; i++) {
+      if (!strcmp(argv[i], flag)) {
+        return argv[i + 1];
+      }
+    }
+    return getenv(env);
+  }
+
+  static void cpu_config_parse(cpu_config *config, int argc, char **argv) {
+    static int order[CPU_MAX];
+    config->count = cpu_topology(order, &config->cores);
+
+    const char *pin = cpu_option(argc, argv, "--pin", "VOXEL_PIN");
+    const char *role = cpu_option(argc, argv, "--main", "VOXEL_MAIN");
+    const char *threads = cpu_option(argc, argv, "--threads", "VOXEL_THREADS");
+    const char *numa = cpu_option(argc, argv, "--numa", "VOXEL_NUMA");
+    const char *isa = cpu_option(argc, argv, "--isa", "VOXEL_ISA");
+
+    config->pin = CPU_PIN_NONE;
+    if (pin && !strcmp(pin, "cores")) {
+      config->pin = CPU_PIN_CORES;
+    } else if (pin && !strcmp(pin, "smt")) {
+      config->pin = CPU_PIN_SMT;
+    } else if (pin && strcmp(pin, "none")) {
+      fprintf(stderr, "unknown pin mode '%s', expected none, cores or smt\n", pin);
+    }
+
+    config->main = CPU_MAIN_RENDER;
+    if (role && !strcmp(role, "present")) {
+      config->main = CPU_MAIN_PRESENT;
+    } else if (role && strcmp(role, "render")) {
+      fprintf(stderr, "unknown main thread role '%s', expected render or present\n", role);
+    }
+
+    int usable = config->pin == CPU_PIN_SMT ? config->count : config->cores;
+    usable = usable < 1 ? 1 : usable;
+
+    int n = threads ? atoi(threads) : usable;
+    config->threads = n < 1 ? 1 : (n > CPU_MAX_THREADS ? CPU_MAX_THREADS : n);
+
+    // more threads than cpus wrap around
+    for (int i=0; i<config->threads; i++) {
+      config->cpus[i] = config->pin == CPU_PIN_NONE ? -1 : order[i % usable];
+      config->nodes[i] = config->cpus[i] < 0 ? -1 : numa_node_of_cpu(config->cpus[i]);
+    }
+
+    int nodes = numa_node_count();
+    config->numa = nodes < 2 ? NUMA_NONE : (config->pin == CPU_PIN_NONE ? NUMA_INTERLEAVE : NUMA_REPLICATE);
+    if (numa && !strcmp(numa, "none")) {
+      config->numa = NUMA_NONE;
+    } else if (numa && !strcmp(numa, "interleave")) {
+      config->numa = NUMA_INTERLEAVE;
+    } else if (numa && !strcmp(numa, "replicate")) {
+      config->numa = NUMA_REPLICATE;
+    } else if (numa) {
+      fprintf(stderr, "unknown numa mode '%s', expected none, interleave or replicate\n", numa);
+    }
+
+    // floating threads have no node to read a replica from
+    if (config->numa == NUMA_REPLICATE && config->pin == CPU_PIN_NONE) {
+      fprintf(stderr, "numa replication needs --pin, interleaving instead\n");
+      config->numa = NUMA_INTERLEAVE;
+    }
+
+    if (isa && isa_parse(isa) < 0) {
+      fprintf(stderr, "unknown isa '%s', expected baseline, sse4.2, avx2 or avx512\n", isa);
+    } else if (isa) {
+      isa_limit(isa_parse(isa));
+    }
+    config->isa = isa_level();
+  }
+
+  static const char *cpu_numa_name(const int numa) {
+    return numa == NUMA_REPLICATE ? "replicate" : (numa == NUMA_INTERLEAVE ? "interleave" : "none");
+  }
+
+  static const char *cpu_pin_name(const int pin) {
+    return pin == CPU_PIN_SMT ? "smt" : (pin == CPU_PIN_CORES ? "cores" : "none");
+  }
+
+  static void cpu_pin_self(const int cpu) {
+    if (cpu < 0) {
+      return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+      fprintf(stderr, "could not pin the main thread to cpu %i\n", cpu);
+    }
+  }
+
+  // pool running every render thread besides the main one, NULL when the
+  // main thread renders alone
+  static threadpool cpu_pool_create(const cpu_config *config) {
+    int first = config->main == CPU_MAIN_RENDER;
+    if (first) {
+      cpu_pin_self(config->cpus[0]);
+    }
+
+    int workers = config->threads - first;
+    return workers > 0 ? thpool_init_affinity(workers, config->cpus + first) : NULL;
+  }
+#endif
@@ -0,0 +1,66 @@
+#ifndef __ISA__
+#define __ISA__
+  #include <string.h>
+
+  // the build targets the compiler's baseline, hot kernels are compiled
+  // again for newer instruction sets (with target attributes) and picked
+  // from cpuid the first time they run. isa_limit caps the choice, to
+  // compare the variants on one machine or to dodge a broken one
+
+  #define ISA_BASELINE 0
+  #define ISA_SSE42 1
+  #define ISA_AVX2 2
+  #define ISA_AVX512 3
+
+  // highest variant this process may pick, set before the first kernel runs
+  static int isa_max = ISA_AVX512;
+
+  static const char *isa_name(const int isa) {
+    switch (isa) {
+      case ISA_SSE42: return "sse4.2";
+      case ISA_AVX2: return "avx2";
+      case ISA_AVX512: return "avx512";
+    }
+    return "baseline";
+  }
+
+  // parses one of isa_name's names, -1 when unknown
+  static int isa_parse(const char *name) {
+    for (int isa=ISA_BASELINE; isa<=ISA_AVX512; isa++) {
+      if (!strcmp(name, isa_name(isa))) {
+        return isa;
+      }
+    }
+    return -1;
+  }
+
+  static void isa_limit(const int isa) {
+    isa_max = isa;
+  }
+
+  // best variant the cpu runs, within isa_max
+  static int isa_level() {
+    __builtin_cpu_init();
+
+    int isa = ISA_BASELINE;
+    if (__builtin_cpu_supports("sse4.2")) {
+      isa = ISA_SSE42;
+    }
+    if (isa == ISA_SSE42 && __builtin_cpu_supports("avx2")) {
+      isa = ISA_AVX2;
+    }
+    if (isa == ISA_AVX2 &&
+      __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512dq")
+    ) {
+      isa = ISA_AVX512;
+    }
+    return isa < isa_max ? isa : isa_max;
+  }
+
+  #define ISA_TARGET_SSE42 __attribute__((target("sse4.2")))
+  #define ISA_TARGET_AVX2 __attribute__((target("avx2")))
+  #define ISA_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512vl,avx512bw,avx512dq")))
+#endif
@@ -1,3 +1,4 @@
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,15 +11,12 @@
 #include "ray-aabb.h"
 #include "orbit-camera.h"
 #include "voxel.h"
-
-#define ENABLE_THREADS
-#ifdef ENABLE_THREADS
-  #define TOTAL_THREADS 7
-#else
-  #define TOTAL_THREADS 1
-#endif
-
-#define RENDER
+#include "voxel-packet.h"
+#include "world.h"
+#include "render.h"
+#include "scene.h"
+#include "cpu.h"
+#include "present.h"
 
 struct {
   uint8_t down;
@@ -63,152 +61,24 @@ void vec3_print(const vec3 v) {
   printf("(%f, %f, %f)\n", v[0], v[1], v[2]);
 }
 
-typedef struct {
-  uint8_t *data;
-  int x;
-  int y;
-  int width;
-  int height, screen_height;
-  int stride;
-  int render_id;
-  vec3 pos;
-  vec3 dcol;
-  vec3 drow;
-  vec3 ro;
-  vec4 color;
-  voxel_brick brick;
-} screen_area;
-
-float brick_fill(const unsigned int x, const unsigned int y, const unsigned int z) {
-  if (x == VOXEL_BRICK_HALF_WIDTH ||
-      y == VOXEL_BRICK_HALF_WIDTH ||
-      z == VOXEL_BRICK_HALF_WIDTH
-  ) {
-    return 100.0f;
-  }
-
-  float dx = x - VOXEL_BRICK_HALF_WIDTH;
-  float dy = y - VOXEL_BRICK_HALF_WIDTH;
-  float dz = z - VOXEL_BRICK_HALF_WIDTH;
-
-  float d = sqrtf(dx*dx + dy*dy + dz*dz);
-  if (d < VOXEL_BRICK_HALF_WIDTH) {
-    return 100.0f;
-  }
-  // return x > 0 && x < VOXEL_BRICK_WIDTH-1 && y > 0 && y < VOXEL_BRICK_WIDTH-1 && z > 0 && z < VOXEL_BRICK_WIDTH-1 ? 100.0f : 0;//(x%2 == 0 && y%2 == 0 && z%2 == 0) ? 100.0f : 0.0f;
-
- return 0.0f;
-}
-
-void render_screen_area(void *args) {
-  ray3 ray;
-  float t = 0;
-
-  screen_area *c = (screen_area *)args;
-  int width = c->width;
-  int height = c->height;
-  int stride = c->stride;
-  vec3 planeXPosition;
-
-  vec3 dcol, drow, ro, rd, normal, o;
-  dcol = c->dcol;
-  drow = c->drow;
-  ro = c->ro;
-  uint8_t *data = c->data;
-  ray_packet3 packet;
-  packet.origin[0] = vec3f(ro[0]);
-  packet.origin[1] = vec3f(ro[1]);
-  packet.origin[2] = vec3f(ro[2]);
-  vec3 planeYPosition = dcol * vec3f(c->y) + c->pos;
-  vec3 invdir[4], dir[4];
-  vec3 m;
-  float r = VOXEL_BRICK_HALF_SIZE * 0.99f;
-  int result;
-  int x, y;
-
-  aabb_packet bounds;
-  bounds[0] = _mm_sub_ps(c->brick->bounds_packet[0], vec3f(ro[0]));
-  bounds[1] = _mm_sub_ps(c->brick->bounds_packet[1], vec3f(ro[1]));
-  bounds[2] = _mm_sub_ps(c->brick->bounds_packet[2], vec3f(ro[2]));
-  bounds[3] = _mm_sub_ps(c->brick->bounds_packet[3], vec3f(ro[0]));
-  bounds[4] = _mm_sub_ps(c->brick->bounds_packet[4], vec3f(ro[1]));
-  bounds[5] = _mm_sub_ps(c->brick->bounds_packet[5], vec3f(ro[2]));
-
-  for (y=c->y; y<height; ++y) {
-    planeXPosition = planeYPosition;
-    for (x=0; x<width; x+=4) {
-      for (int i=0; i<4; i++) {
-        planeXPosition += drow;
-        rd = planeXPosition - ro;
-        dir[i] = rd;
-        invdir[i] = vec3_reciprocal(rd);
-        packet.invdir[0][i] = invdir[i][0];
-        packet.invdir[1][i] = invdir[i][1];
-        packet.invdir[2][i] = invdir[i][2];
-      }
-
-      result = ray_isect_packet(packet, bounds, &m);
-      for (int j=0; j<4; j++) {
-        unsigned long where = y * width * stride + (x + j) * stride;
-
-        int cr = floor(((x+j)/(float)width) * 255);
-        int cg = floor((y/(float)c->screen_height) * 255);
-        int cb = 0;
-
-        if (result & (1<<j)) {
-          vec3 isect = ro + dir[j] * vec3f(m[j]);
-          o = isect - c->brick->center;
-
-          for (int k=0; k<3; k++) {
-            if (fabsf(o[k]) >= r) {
-              normal[k] = o[k] > 0.0f ? 1.0f : -1.0f;
-            } else {
-              normal[k] = 0.0f;
-            }
-          }
-
-          float sum = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
-
-          int voxel_pos[3] = { 0, 0, 0 };
-          int found = voxel_brick_traverse(
-            c->brick,
-            isect,
-            vec3_norm(dir[j]),
-            1.0f,
-            voxel_pos
-          );
-
-          if (found) {
-            cr = (int)((voxel_pos[0] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
-            cg = (int)((voxel_pos[1] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
-            cb = (int)((voxel_pos[2] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
-          } else {
-            cr = fmaxf(0, cr - 20);
-            cg = fmaxf(0, cg - 20);
-            cb = fmaxf(0, cb - 20);
-          }
-
-          if (sum >= 2) {
-            cr = fmaxf(0, cr - 20);
-            cg = fmaxf(0, cg - 20);
-            cb = fmaxf(0, cb - 20);
-          }
-        }
-        data[where+0] = cr;
-        data[where+1] = cg;
-        data[where+2] = cb;
-      }
-    }
-    planeYPosition += dcol;
-  }
-}
-
-int main(void)
+int main(int argc, char **argv)
 {
 
   _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
   _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
+  cpu_config cpus;
+  cpu_config_parse(&cpus, argc, argv);
+  printf("%i threads (%i cores, %i cpus), pin: %s, main thread: %s, numa: %s, isa: %s\n",
+    cpus.threads,
+    cpus.cores,
+    cpus.count,
+    cpu_pin_name(cpus.pin),
+    cpus.main == CPU_MAIN_RENDER ? "render" : "present",
+    cpu_numa_name(cpus.numa),
+    isa_name(cpus.isa)
+  );
+
   int width = 800, height = 600;
   GLFWwindow* window;
   glfwSetErrorCallback(error_callback);
@@ -235,14 +105,13 @@ int main(void)
 
   // TODO: handle resize
 
-  int dw, dh;
-  glfwGetFramebufferSize(window, &dw, &dh);
-  int stride = 3;
-  int total = dw*dh*stride;
-  uint8_t *data = malloc(total);
+  // 4 bytes per pixel unless --stride 3 (or VOXEL_STRIDE=3) asks for RGB
+  const char *format = cpu_option(argc, argv, "--stride", "VOXEL_STRIDE");
+  int stride = format && atoi(format) == 3 ? 3 : 4;
+  present screen = present_create(window, stride);
 
-  vec3 ro; //, rd;
-  mat4 m4inverted, view;
+  render_view frame_view;
+  mat4 view;
   mat4 projection;
   mat4_perspective(
     projection,
@@ -251,22 +120,27 @@ int main(void)
     0.1,
     1000.0
   );
-  GLuint texture[1];
 
-#ifdef ENABLE_THREADS
-  screen_area areas[TOTAL_THREADS];
-  threadpool thpool = thpool_init(TOTAL_THREADS);
-#else
-  screen_area areas[1];
-#endif
+  threadpool thpool = cpu_pool_create(&cpus);
+  render_tiles tiles = render_tiles_create(cpus.threads, RENDER_TILE_SIZE);
+  if (!tiles) {
+    fprintf(stderr, "out of memory\n");
+    glfwTerminate();
+    exit(EXIT_FAILURE);
+  }
+  tiles->caller = cpus.main == CPU_MAIN_RENDER;
+
+  // frame n + 1 renders on the workers while the main thread uploads and
+  // presents frame n, unless --pipeline 0 (or VOXEL_PIPELINE=0). a single
+  // render thread has nothing to overlap with
+  const char *overlap = cpu_option(argc, argv, "--pipeline", "VOXEL_PIPELINE");
+  int pipeline = thpool && !(overlap && atoi(overlap) == 0);
+  int presentable = 0;
 
-  glGenTextures(1, texture);
   float start = glfwGetTime();
   int fps = 0;
-  voxel_brick my_first_brick = voxel_brick_create();
-  // TODO: make this work when the brick lb corner is not oriented at 0,0,0
-  voxel_brick_position(my_first_brick, vec3f(0.0f));
-  voxel_brick_fill(my_first_brick, &brick_fill);
+  voxel_world world = scene_create(thpool);
+  render_tiles_place(tiles, world, cpus.numa, cpus.nodes);
 
   while (!glfwWindowShouldClose(window)) {
     if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
@@ -289,7 +163,7 @@ int main(void)
     float now = glfwGetTime();
     if (now - start > 1) {
       unsigned long long total_rays = (fps * width * height);
-      printf("fps: %i (%f Mrays/s)@%ix%i - %i threads\n", fps, total_rays/1000000.0, width, height, TOTAL_THREADS);
+      printf("fps: %i (%f Mrays/s)@%ix%i - %i threads\n", fps, total_rays/1000000.0, width, height, cpus.threads);
       start = now;
       fps = 0;
     }
@@ -297,88 +171,39 @@ int main(void)
 
 
     orbit_camera_view(view);
-    ro = mat4_get_eye(view);
-
-    mat4_mul(m4inverted, projection, view);
-    mat4_invert(m4inverted, m4inverted);
-
-    // compute 3 points so that we can interpolate instead of unprojecting
-    // on every point
-    vec3 rda, rdb, planeYPosition, dcol, drow;
-
-    vec3 t0 = vec3_create(0, 0, 0), tx = vec3_create(1, 0, 0), ty = vec3_create(0, 1, 0);
-    vec4 viewport = { 0, 0, width, height };
-
-    rda = orbit_camera_unproject(t0, viewport, m4inverted);
-    rdb = orbit_camera_unproject(tx, viewport, m4inverted);
-    planeYPosition = orbit_camera_unproject(ty, viewport, m4inverted);
-    dcol = planeYPosition - rda;
-    drow = rdb - rda;
-
-    int i=0, bh = height;
-#ifdef ENABLE_THREADS
-    bh = (height/TOTAL_THREADS);
-
-    for (i; i<TOTAL_THREADS; i++) {
-#endif
-      areas[i].dcol = dcol;
-      areas[i].drow = drow;
-      areas[i].pos = planeYPosition;
-      areas[i].ro = ro;
-      areas[i].x = 0;
-      areas[i].y = i*bh;
-      areas[i].width = width;
-      areas[i].height = areas[i].y + (int)(bh);
-      areas[i].screen_height = (int)(height);
-      areas[i].stride = stride;
-      areas[i].data = data;
-      areas[i].render_id = i;
-      areas[i].brick = my_first_brick;
-#ifdef ENABLE_THREADS
-      thpool_add_work(thpool, (void *)render_screen_area, (void *)(&areas[i]));
+    render_view_create(&frame_view, view, projection, width, height);
+    // rendered straight into the upload buffer
+    uint8_t *data = present_map(screen, width, height);
+    if (!data) {
+      // nothing to render into, show what is done and try again next time
+      if (pipeline && presentable) {
+        present_frame(screen);
+        glfwSwapBuffers(window);
+        presentable = 0;
+      }
+      glfwPollEvents();
+      continue;
     }
 
-    thpool_wait(thpool);
-#else
-    render_screen_area((void *)(&areas[i]));
-#endif
-
-#ifdef RENDER
-    glViewport(0, 0, width, height);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDisable(GL_CULL_FACE);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    render_frame_start(thpool, tiles, &frame_view, world, data, width, height, stride);
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-
-    glMatrixMode(GL_TEXTURE);
-    glLoadIdentity();
-    glScalef(1.0f, -1.0f, 1.0f);
-
-    glEnable(GL_TEXTURE_2D);
-
-    glBindTexture(GL_TEXTURE_2D, texture[0]);
-    glTexImage2D(GL_TEXTURE_2D, 0, 3, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-
-    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-
-    glBegin(GL_QUADS);
-      glTexCoord2f(0.0f, 0.0f); glVertex2f( -1, -1);
-      glTexCoord2f(1.0f, 0.0f); glVertex2f(  1, -1);
-      glTexCoord2f(1.0f, 1.0f); glVertex2f(  1,  1);
-      glTexCoord2f(0.0f, 1.0f); glVertex2f( -1,  1);
-    glEnd();
+    if (pipeline && presentable) {
+      present_frame(screen);
+      glfwSwapBuffers(window);
+    }
 
-    glfwSwapBuffers(window);
+    render_frame_finish(thpool, tiles);
 
-    glDeleteTextures(1, &texture[0]);
-#endif
+    if (pipeline) {
+      presentable = 1;
+    } else {
+      present_frame(screen);
+      glfwSwapBuffers(window);
+    }
 
     glfwPollEvents();
   }
+  present_destroy(screen);
   glfwDestroyWindow(window);
   glfwTerminate();
   exit(EXIT_SUCCESS);
@@ -0,0 +1,87 @@
+#ifndef __MEM__
+#define __MEM__
+  #include <stdint.h>
+  #include <stdlib.h>
+  #include <string.h>
+#ifdef __linux__
+  #include <sys/mman.h>
+#endif
+
+  // allocator for voxel payloads. every block is at least cache line
+  // aligned, blocks of a huge page or more are backed by huge pages so the
+  // random reads of a traversal do not thrash the dTLB: explicit (hugetlbfs)
+  // pages when the system has some reserved, otherwise 2MiB aligned memory
+  // flagged for transparent huge pages. small blocks and other systems fall
+  // back to posix_memalign
+
+  #define MEM_ALIGN 64
+  #define MEM_HUGE_PAGE (2u << 20)
+
+  static inline size_t mem_huge_size(const size_t size) {
+    return (size + MEM_HUGE_PAGE - 1) & ~((size_t)MEM_HUGE_PAGE - 1);
+  }
+
+  // zero filled like calloc, release it with mem_free(ptr, size)
+  static void *mem_alloc(const size_t size) {
+#ifdef __linux__
+    if (size >= MEM_HUGE_PAGE) {
+      const size_t huge = mem_huge_size(size);
+
+#ifdef MAP_HUGETLB
+      void *out = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (out != MAP_FAILED) {
+        return out;
+      }
+#endif
+
+      // over map by a page and trim both ends to get a 2MiB aligned block
+      uint8_t *raw = (uint8_t *)mmap(NULL, huge + MEM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (raw != MAP_FAILED) {
+        uint8_t *start = (uint8_t *)(((uintptr_t)raw + MEM_HUGE_PAGE - 1) & ~((uintptr_t)MEM_HUGE_PAGE - 1));
+        if (start > raw) {
+          munmap(raw, start - raw);
+        }
+        munmap(start + huge, raw + huge + MEM_HUGE_PAGE - (start + huge));
+#ifdef MADV_HUGEPAGE
+        madvise(start, huge, MADV_HUGEPAGE);
+#endif
+        return start;
+      }
+    }
+#endif
+
+    void *out = NULL;
+    if (posix_memalign(&out, MEM_ALIGN, size)) {
+      return NULL;
+    }
+    memset(out, 0, size);
+    return out;
+  }
+
+  // hand the pages of a mem_alloc block (or a huge page aligned part of
+  // one) back to the system. it reads as zeros again afterwards and is
+  // repopulated on first touch
+  static void mem_discard(void *ptr, const size_t size) {
+#if defined(__linux__) && defined(MADV_DONTNEED)
+    if (size >= MEM_HUGE_PAGE && !madvise(ptr, mem_huge_size(size), MADV_DONTNEED)) {
+      return;
+    }
+#endif
+    memset(ptr, 0, size);
+  }
+
+  // `size` must match the one given to mem_alloc
+  static void mem_free(void *ptr, const size_t size) {
+    if (!ptr) {
+      return;
+    }
+
+#ifdef __linux__
+    if (size >= MEM_HUGE_PAGE) {
+      munmap(ptr, mem_huge_size(size));
+      return;
+    }
+#endif
+    free(ptr);
+  }
+#endif
@@ -0,0 +1,102 @@
+#ifndef __NUMA__
+#define __NUMA__
+  #include <stdio.h>
+  #include <stdlib.h>
+  #include <stdint.h>
+  #include <unistd.h>
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <linux/mempolicy.h>
+#endif
+
+  // numa topology from sysfs and memory placement through mbind, without
+  // pulling in libnuma. everything degrades to a single node elsewhere
+
+  #define NUMA_MAX_NODES 64
+
+  // how brick memory is spread over the nodes
+  //   NONE: left where it was first touched
+  //   INTERLEAVE: pages round robin over every node
+  //   REPLICATE: one copy of the world per node, workers read their own
+  #define NUMA_NONE 0
+  #define NUMA_INTERLEAVE 1
+  #define NUMA_REPLICATE 2
+
+  // highest online node + 1
+  static int numa_node_count() {
+    char line[256];
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f) {
+      return 1;
+    }
+
+    int count = 1;
+    if (fgets(line, sizeof(line), f)) {
+      // a list of ranges like "0-1,3", the last number is the highest node
+      char *p = line, *end;
+      for (;;) {
+        long n = strtol(p, &end, 10);
+        if (end == p) {
+          break;
+        }
+        count = n + 1 > count ? (int)n + 1 : count;
+        p = *end ? end + 1 : end;
+      }
+    }
+    fclose(f);
+    return count > NUMA_MAX_NODES ? NUMA_MAX_NODES : count;
+  }
+
+  // node owning `cpu`, 0 when unknown
+  static int numa_node_of_cpu(const int cpu) {
+    char path[128];
+    int count = numa_node_count();
+    for (int n=0; n<count; n++) {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/node%i", cpu, n);
+      if (!access(path, F_OK)) {
+        return n;
+      }
+    }
+    return 0;
+  }
+
+  // move the whole pages inside `ptr, size` to `node`, or spread them over
+  // every node when `node` < 0. pages already touched are migrated, the
+  // rest land there on first touch. returns 0 on success
+  static int numa_place(void *ptr, const size_t size, const int node) {
+#ifdef __linux__
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(page - 1);
+    if (end <= start) {
+      return 0;
+    }
+
+    unsigned long mask = 0;
+    int mode = MPOL_PREFERRED;
+    if (node < 0) {
+      mode = MPOL_INTERLEAVE;
+      int count = numa_node_count();
+      mask = count >= 64 ? ~0UL : (1UL << count) - 1;
+    } else {
+      mask = 1UL << node;
+    }
+
+    // maxnode counts one past the last bit the kernel may read
+    return (int)syscall(SYS_mbind, start, end - start, mode, &mask, NUMA_MAX_NODES + 1, MPOL_MF_MOVE);
+#else
+    return 0;
+#endif
+  }
+
+  // page aligned (so all of it can be placed) block on `node`, release it
+  // with free()
+  static void *numa_alloc(const size_t size, const int node) {
+    void *out = NULL;
+    if (posix_memalign(&out, (size_t)sysconf(_SC_PAGESIZE), size)) {
+      return NULL;
+    }
+    numa_place(out, size, node);
+    return out;
+  }
+#endif
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <thpool.h>
+
+#include "vec.h"
+#include "world.h"
+#include "render.h"
+#include "scene.h"
+#include "cpu.h"
+#include "writer.h"
+
+// headless renderer for batch jobs: renders a camera script (or an orbit
+// around the scene) without a window and writes every frame out, see
+// writer.h
+//
+//   offscreen [--script file] [--frames n] [--output path] [--format ppm|raw]
+//             [--width w] [--height h] [--tile n] [--stride 3|4]
+//             [--threads n] [--pin mode] [--main role] [--numa mode]
+//             [--isa level]
+//
+// a script has one frame per line, the eye and the point it looks at,
+// optionally followed by the up vector (0 1 0 otherwise). '#' starts a
+// comment and "-" reads the script from stdin:
+//
+//   # eye x y z    center x y z    up x y z
+//   0 0 256        0 0 0           0 1 0
+//
+// without a script --frames (default 1) poses orbit the scene. the output
+// defaults to frame-%04i.ppm (or .raw), "-" streams to stdout. progress
+// goes to stderr
+
+typedef struct {
+  float eye[3], center[3], up[3];
+} offscreen_pose;
+
+static int offscreen_arg(int argc, char **argv, const char *name, int fallback) {
+  for (int i=1; i<argc - 1; i++) {
+    if (!strcmp(argv[i], name)) {
+      return atoi(argv[i + 1]);
+    }
+  }
+  return fallback;
+}
+
+// returns the pose count, -1 when the script can not be read
+static int offscreen_script(const char *path, offscreen_pose **out) {
+  FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!f) {
+    return -1;
+  }
+
+  char line[1024];
+  int count = 0, capacity = 0, number = 0;
+  *out = NULL;
+
+  while (fgets(line, sizeof(line), f)) {
+    number++;
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = 0;
+    }
+
+    offscreen_pose pose;
+    pose.up[0] = 0.0f;
+    pose.up[1] = 1.0f;
+    pose.up[2] = 0.0f;
+    int n = sscanf(line, "%f %f %f %f %f %f %f %f %f",
+      &pose.eye[0], &pose.eye[1], &pose.eye[2],
+      &pose.center[0], &pose.center[1], &pose.center[2],
+      &pose.up[0], &pose.up[1], &pose.up[2]
+    );
+
+    // blank or comment only
+    if (n == EOF) {
+      continue;
+    }
+
+    if (n != 6 && n != 9) {
+      fprintf(stderr, "%s:%i: expected eye, center and optionally up\n", path, number);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      *out = (offscreen_pose *)realloc(*out, sizeof(offscreen_pose) * capacity);
+    }
+    (*out)[count++] = pose;
+  }
+
+  if (f != stdin) {
+    fclose(f);
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+  _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+  cpu_config cpus;
+  cpu_config_parse(&cpus, argc, argv);
+  int frames = offscreen_arg(argc, argv, "--frames", 1);
+  int width = offscreen_arg(argc, argv, "--width", 800);
+  int height = offscreen_arg(argc, argv, "--height", 600);
+  int tile = offscreen_arg(argc, argv, "--tile", RENDER_TILE_SIZE);
+  int stride = offscreen_arg(argc, argv, "--stride", 4) == 3 ? 3 : 4;
+
+  const char *script = cpu_option(argc, argv, "--script", "VOXEL_SCRIPT");
+  const char *format = cpu_option(argc, argv, "--format", "VOXEL_FORMAT");
+  const char *output = cpu_option(argc, argv, "--output", "VOXEL_OUTPUT");
+
+  int kind = WRITER_PPM;
+  if (format && !strcmp(format, "raw")) {
+    kind = WRITER_RAW;
+  } else if (format && strcmp(format, "ppm")) {
+    fprintf(stderr, "unknown format '%s', expected ppm or raw\n", format);
+    return 1;
+  }
+
+  if (!output) {
+    output = kind == WRITER_RAW ? "frame-%04i.raw" : "frame-%04i.ppm";
+  }
+
+  if (width < 1 || height < 1) {
+    fprintf(stderr, "invalid size %ix%i\n", width, height);
+    return 1;
+  }
+
+  offscreen_pose *poses = NULL;
+  if (script) {
+    frames = offscreen_script(script, &poses);
+    if (frames < 0) {
+      fprintf(stderr, "could not read %s\n", script);
+      return 1;
+    }
+  }
+
+  if (frames < 1) {
+    fprintf(stderr, "nothing to render\n");
+    free(poses);
+    return 1;
+  }
+
+  writer out = writer_create(output, kind, width, height, stride);
+  if (!out) {
+    free(poses);
+    return 1;
+  }
+
+  render_tiles tiles = render_tiles_create(cpus.threads, tile);
+  if (!tiles) {
+    fprintf(stderr, "out of memory\n");
+    writer_destroy(out);
+    free(poses);
+    return 1;
+  }
+  tiles->caller = cpus.main == CPU_MAIN_RENDER;
+  threadpool pool = cpu_pool_create(&cpus);
+
+  voxel_world world = scene_create(pool);
+  render_tiles_place(tiles, world, cpus.numa, cpus.nodes);
+
+  mat4 projection, view;
+  mat4_perspective(projection, M_PI/4.0, (float)width/(float)height, 0.1, 1000.0);
+
+  render_view frame_view;
+  double start = render_time();
+
+  for (int f=0; f<frames; f++) {
+    if (poses) {
+      offscreen_pose *p = &poses[f];
+      mat4_look_at(
+        view,
+        vec3_create(p->eye[0], p->eye[1], p->eye[2]),
+        vec3_create(p->center[0], p->center[1], p->center[2]),
+        vec3_create(p->up[0], p->up[1], p->up[2])
+      );
+    } else {
+      scene_orbit(view, f, frames);
+    }
+    render_view_create(&frame_view, view, projection, width, height);
+
+    uint8_t *data = writer_acquire(out);
+    render_frame(pool, tiles, &frame_view, world, data, width, height, stride);
+    writer_submit(out, f);
+  }
+
+  // everything written, not just rendered
+  int failed = writer_destroy(out);
+  double elapsed = render_time() - start;
+  fprintf(stderr, "%i frames at %ix%i in %.3fs (%.3f ms/frame), %i threads, %s\n",
+    frames,
+    width,
+    height,
+    elapsed,
+    elapsed / frames * 1000.0,
+    cpus.threads,
+    isa_name(cpus.isa)
+  );
+
+  if (pool) {
+    thpool_destroy(pool);
+  }
+  render_tiles_destroy(tiles);
+  free(poses);
+  return failed ? 1 : 0;
+}
@@ -3,7 +3,7 @@
 
   #include "vec.h"
 
-  struct {
+  static struct {
     quat rotation;
     vec3 center, v3scratch;
     float distance;
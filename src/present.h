@@ -0,0 +1,202 @@
+#ifndef __PRESENT__
+#define __PRESENT__
+  #ifndef GLFW_INCLUDE_GLEXT
+    #define GLFW_INCLUDE_GLEXT
+  #endif
+  #include <GLFW/glfw3.h>
+  #include <stdint.h>
+  #include <stdlib.h>
+  #include <string.h>
+
+  // Puts cpu rendered frames on screen. The texture is created once (and
+  // again on resize only) and updated with glTexSubImage2D. With pixel
+  // buffer objects (GL 2.1 or ARB_pixel_buffer_object) frames are rendered
+  // straight into mapped buffers from a small ring, so the upload is an
+  // asynchronous dma from that buffer instead of a synchronous copy out of
+  // client memory. Without them every slot of the ring is a client side
+  // buffer.
+  //
+  // Slots are presented in the order they were mapped, so a frame can be
+  // rendering into one slot while the previous one is uploaded and drawn:
+  //
+  //   uint8_t *data = present_map(p, width, height);
+  //   ... render width * height * stride bytes into data ...
+  //   present_frame(p);
+
+  #define PRESENT_BUFFERS 3
+
+  typedef struct {
+    int width, height;
+    // where the frame goes, the mapped buffer or `client`
+    uint8_t *data;
+    int mapped;
+    uint8_t *client;
+    size_t client_size;
+  } present_slot;
+
+  typedef struct {
+    int stride;
+    // GL_RGB or GL_RGBA, from the stride
+    GLenum format;
+    GLuint texture;
+    int width, height;
+    GLuint buffers[PRESENT_BUFFERS];
+    present_slot slots[PRESENT_BUFFERS];
+    // oldest slot waiting to be presented and how many are waiting
+    int head, pending;
+    // pixel buffer object entry points, NULL without support
+    PFNGLGENBUFFERSPROC gen_buffers;
+    PFNGLDELETEBUFFERSPROC delete_buffers;
+    PFNGLBINDBUFFERPROC bind_buffer;
+    PFNGLBUFFERDATAPROC buffer_data;
+    PFNGLMAPBUFFERPROC map_buffer;
+    PFNGLUNMAPBUFFERPROC unmap_buffer;
+  } *present, present_t;
+
+  // `window`'s context must be current, `stride` is 3 (RGB) or 4 (RGBA)
+  static present present_create(GLFWwindow *window, const int stride) {
+    present out = (present)calloc(1, sizeof(present_t));
+    out->stride = stride;
+    out->format = stride == 4 ? GL_RGBA : GL_RGB;
+
+    int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+    if (major > 2 || (major == 2 && minor >= 1) || glfwExtensionSupported("GL_ARB_pixel_buffer_object")) {
+      out->gen_buffers = (PFNGLGENBUFFERSPROC)glfwGetProcAddress("glGenBuffers");
+      out->delete_buffers = (PFNGLDELETEBUFFERSPROC)glfwGetProcAddress("glDeleteBuffers");
+      out->bind_buffer = (PFNGLBINDBUFFERPROC)glfwGetProcAddress("glBindBuffer");
+      out->buffer_data = (PFNGLBUFFERDATAPROC)glfwGetProcAddress("glBufferData");
+      out->map_buffer = (PFNGLMAPBUFFERPROC)glfwGetProcAddress("glMapBuffer");
+      out->unmap_buffer = (PFNGLUNMAPBUFFERPROC)glfwGetProcAddress("glUnmapBuffer");
+    }
+
+    if (!out->gen_buffers || !out->delete_buffers || !out->bind_buffer ||
+        !out->buffer_data || !out->map_buffer || !out->unmap_buffer
+    ) {
+      out->gen_buffers = NULL;
+    } else {
+      out->gen_buffers(PRESENT_BUFFERS, out->buffers);
+    }
+
+    glGenTextures(1, &out->texture);
+    glBindTexture(GL_TEXTURE_2D, out->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // rows are tightly packed, an RGB row is not always a multiple of 4
+    glPixelStorei(GL_UNPACK_ALIGNMENT, stride == 4 ? 4 : 1);
+    return out;
+  }
+
+  // buffer to render the next frame into, valid until its present_frame.
+  // NULL when every slot is still waiting to be presented or there is no
+  // memory for it, no slot is taken then
+  static uint8_t *present_map(present p, const int width, const int height) {
+    if (p->pending == PRESENT_BUFFERS) {
+      return NULL;
+    }
+
+    int index = (p->head + p->pending) % PRESENT_BUFFERS;
+    present_slot *slot = &p->slots[index];
+    size_t size = (size_t)width * height * p->stride;
+    slot->width = width;
+    slot->height = height;
+    slot->mapped = 0;
+    slot->data = NULL;
+
+    if (p->gen_buffers) {
+      // reallocating the storage orphans whatever the gpu may still be
+      // reading, so the map never stalls on it
+      p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, p->buffers[index]);
+      p->buffer_data(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)size, NULL, GL_STREAM_DRAW);
+      slot->data = (uint8_t *)p->map_buffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+      slot->mapped = slot->data != NULL;
+      p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    // no pixel buffer objects, or mapping failed
+    if (!slot->data) {
+      if (slot->client_size < size) {
+        free(slot->client);
+        slot->client = (uint8_t *)malloc(size);
+        slot->client_size = slot->client ? size : 0;
+      }
+      slot->data = slot->client;
+    }
+
+    if (!slot->data) {
+      return NULL;
+    }
+
+    p->pending++;
+    return slot->data;
+  }
+
+  // uploads the oldest mapped frame and draws it over the whole viewport,
+  // the caller swaps buffers
+  static void present_frame(present p) {
+    if (!p->pending) {
+      return;
+    }
+
+    int index = p->head;
+    present_slot *slot = &p->slots[index];
+    p->head = (p->head + 1) % PRESENT_BUFFERS;
+    p->pending--;
+
+    glBindTexture(GL_TEXTURE_2D, p->texture);
+    if (p->width != slot->width || p->height != slot->height) {
+      p->width = slot->width;
+      p->height = slot->height;
+      glTexImage2D(GL_TEXTURE_2D, 0, p->stride == 4 ? GL_RGBA8 : GL_RGB8, p->width, p->height, 0, p->format, GL_UNSIGNED_BYTE, NULL);
+    }
+
+    if (slot->mapped) {
+      p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, p->buffers[index]);
+      p->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+      // with a buffer bound the last argument is an offset into it
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p->width, p->height, p->format, GL_UNSIGNED_BYTE, 0);
+      p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      slot->mapped = 0;
+    } else {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p->width, p->height, p->format, GL_UNSIGNED_BYTE, slot->data);
+    }
+
+    glViewport(0, 0, p->width, p->height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_CULL_FACE);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glScalef(1.0f, -1.0f, 1.0f);
+
+    glEnable(GL_TEXTURE_2D);
+
+    glBegin(GL_QUADS);
+      glTexCoord2f(0.0f, 0.0f); glVertex2f( -1, -1);
+      glTexCoord2f(1.0f, 0.0f); glVertex2f(  1, -1);
+      glTexCoord2f(1.0f, 1.0f); glVertex2f(  1,  1);
+      glTexCoord2f(0.0f, 1.0f); glVertex2f( -1,  1);
+    glEnd();
+  }
+
+  static void present_destroy(present p) {
+    for (int i=0; i<PRESENT_BUFFERS; i++) {
+      if (p->slots[i].mapped) {
+        p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, p->buffers[i]);
+        p->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+        p->bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      }
+      free(p->slots[i].client);
+    }
+    if (p->gen_buffers) {
+      p->delete_buffers(PRESENT_BUFFERS, p->buffers);
+    }
+    glDeleteTextures(1, &p->texture);
+    free(p);
+  }
+#endif
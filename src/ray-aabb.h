@@ -15,12 +15,14 @@
 #include "ray.h"
 #include "aabb.h"
 #include "vec.h"
+#include "isa.h"
 #include <xmmintrin.h>
 #include <smmintrin.h>
 #include <immintrin.h>
 #include <avxintrin.h>
+#include <float.h>
 
-const __m128 zero = { 0.0f, 0.0f, 0.0f };
+static const __m128 zero = { 0.0f, 0.0f, 0.0f };
 
 static inline int ray_isect_packet(ray_packet3 packet, aabb_packet b, vec3 *m) {
   vec3 invdir;
@@ -56,7 +58,75 @@ static inline int ray_isect_packet(ray_packet3 packet, aabb_packet b, vec3 *m) {
   return _mm_movemask_ps(lmax >= _mm_max_ps(zero, lmin));
 }
 
-uint8_t ray_isect(ray3 *r, aabb b, float *m) {
+// a row segment of up to RAY_SPAN rays tested against one box, stored
+// structure of arrays so each kernel loads 4, 8 or 16 lanes at once
+#define RAY_SPAN 16
+
+typedef struct {
+  float invdir[3][RAY_SPAN];
+} __attribute__((aligned(64))) ray_span;
+
+typedef float ray_vf4 __attribute__((vector_size(16)));
+typedef float ray_vf8 __attribute__((vector_size(32)));
+typedef float ray_vf16 __attribute__((vector_size(64)));
+
+// only ray_isect_span4 runs on the baseline, the others carry a target
+#define RAY_MASK4(a, b) _mm_movemask_ps(_mm_cmpge_ps(a, b))
+#define RAY_MASK8(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ))
+#define RAY_MASK16(a, b) ((int)_mm512_cmp_ps_mask(a, b, _CMP_GE_OQ))
+
+// same test as ray_isect_packet, w lanes at a time. `box` is min xyz then
+// max xyz relative to the ray origin. returns the hit mask of the first
+// `count` lanes and their entry distances in `tnear`
+#define RAY_ISECT_SPAN_DEFINE(w, target, min, max) \
+target \
+static int ray_isect_span##w(const ray_span *rays, const float *box, const int count, float *tnear) { \
+  const ray_vf##w zero = {0}; \
+  int out = 0; \
+  for (int i=0; i<count; i+=w) { \
+    ray_vf##w invdir = *(const ray_vf##w *)&rays->invdir[0][i]; \
+    ray_vf##w lambda1 = box[0] * invdir; \
+    ray_vf##w lambda2 = box[3] * invdir; \
+    ray_vf##w lmin = min(lambda1, lambda2); \
+    ray_vf##w lmax = max(lambda1, lambda2); \
+    \
+    for (int k=1; k<3; k++) { \
+      invdir = *(const ray_vf##w *)&rays->invdir[k][i]; \
+      lambda1 = box[k] * invdir; \
+      lambda2 = box[k + 3] * invdir; \
+      lmin = max(min(lambda1, lambda2), lmin); \
+      lmax = min(max(lambda1, lambda2), lmax); \
+    } \
+    \
+    *(ray_vf##w *)&tnear[i] = lmin; \
+    out |= RAY_MASK##w(lmax, max(zero, lmin)) << i; \
+  } \
+  return out & ((1 << count) - 1); \
+}
+
+RAY_ISECT_SPAN_DEFINE(4, , _mm_min_ps, _mm_max_ps)
+RAY_ISECT_SPAN_DEFINE(8, ISA_TARGET_AVX2, _mm256_min_ps, _mm256_max_ps)
+RAY_ISECT_SPAN_DEFINE(16, ISA_TARGET_AVX512, _mm512_min_ps, _mm512_max_ps)
+
+typedef int (*ray_isect_span_fn)(const ray_span *, const float *, const int, float *);
+
+static int ray_isect_span_resolve(const ray_span *rays, const float *box, const int count, float *tnear);
+
+// the widest kernel this cpu runs, picked on the first call
+static ray_isect_span_fn ray_isect_span = ray_isect_span_resolve;
+
+static ray_isect_span_fn ray_isect_span_select() {
+  int isa = isa_level();
+  return isa == ISA_AVX512 ? ray_isect_span16 : (isa == ISA_AVX2 ? ray_isect_span8 : ray_isect_span4);
+}
+
+static int ray_isect_span_resolve(const ray_span *rays, const float *box, const int count, float *tnear) {
+  ray_isect_span_fn fn = ray_isect_span_select();
+  __atomic_store_n(&ray_isect_span, fn, __ATOMIC_RELAXED);
+  return fn(rays, box, count, tnear);
+}
+
+static uint8_t ray_isect(ray3 *r, aabb b, float *m) {
   float tx1 = (b[0][0] - r->origin[0]) * r->invdir[0];
   float tx2 = (b[1][0] - r->origin[0]) * r->invdir[0];
 
@@ -80,4 +150,216 @@ uint8_t ray_isect(ray3 *r, aabb b, float *m) {
   return tmax >= fmaxf(0.0, tmin);
 }
 
+
+// ray slopes (Eisemann & Magnor): with the slopes and classification from
+// ray3_init a box test is a handful of multiply-adds and compares, no
+// divisions, and the signs are constants inside each of the 27 variants,
+// so every branch on them folds away. for one ray against many boxes
+//
+// a ray misses when its origin already lies past the box along an axis
+// it moves on (or outside the slab of an axis it does not move on), or
+// when, in the projection onto any pair of moving axes, it leaves the far
+// side of one axis before reaching the near side of the other
+static inline __attribute__((always_inline)) int ray_slope_test(
+  const ray3 *r,
+  const aabb b,
+  float *t,
+  const int sx,
+  const int sy,
+  const int sz
+) {
+  const int sign[3] = { sx, sy, sz };
+
+  for (int k=0; k<3; k++) {
+    if ((sign[k] <= 0 && r->origin[k] < b[0][k]) || (sign[k] >= 0 && r->origin[k] > b[1][k])) {
+      return 0;
+    }
+  }
+
+  for (int p=0; p<6; p++) {
+    const int a = ray_pair_a[p], c = ray_pair_b[p];
+    if (!sign[a] || !sign[c]) {
+      continue;
+    }
+
+    // where the ray is along `c` as it leaves the box along `a`
+    float at = r->slope[p] * (sign[a] < 0 ? b[0][a] : b[1][a]) + r->offset[p];
+    if (sign[c] > 0 ? at < b[0][c] : at > b[1][c]) {
+      return 0;
+    }
+  }
+
+  // entry distance: the last near side crossed, in units of `dir`
+  float tnear = sx || sy || sz ? -FLT_MAX : 0.0f;
+  for (int k=0; k<3; k++) {
+    if (sign[k]) {
+      float tk = ((sign[k] > 0 ? b[0][k] : b[1][k]) - r->origin[k]) * r->invdir[k];
+      tnear = tk > tnear ? tk : tnear;
+    }
+  }
+  *t = tnear;
+  return 1;
+}
+
+typedef int (*ray_slope_fn)(const ray3 *, const aabb, float *);
+
+#define RAY_SLOPE_DEFINE(sx, sy, sz) \
+static int ray_slope_##sx##_##sy##_##sz(const ray3 *r, const aabb b, float *t) { \
+  return ray_slope_test(r, b, t, RAY_SIGN_##sx, RAY_SIGN_##sy, RAY_SIGN_##sz); \
+}
+
+#define RAY_SIGN_M -1
+#define RAY_SIGN_O 0
+#define RAY_SIGN_P 1
+
+#define RAY_SLOPE_DEFINE_Z(sx, sy) \
+  RAY_SLOPE_DEFINE(sx, sy, M) \
+  RAY_SLOPE_DEFINE(sx, sy, O) \
+  RAY_SLOPE_DEFINE(sx, sy, P)
+
+#define RAY_SLOPE_DEFINE_YZ(sx) \
+  RAY_SLOPE_DEFINE_Z(sx, M) \
+  RAY_SLOPE_DEFINE_Z(sx, O) \
+  RAY_SLOPE_DEFINE_Z(sx, P)
+
+RAY_SLOPE_DEFINE_YZ(M)
+RAY_SLOPE_DEFINE_YZ(O)
+RAY_SLOPE_DEFINE_YZ(P)
+
+#define RAY_SLOPE_ENTRY_Z(sx, sy) ray_slope_##sx##_##sy##_M, ray_slope_##sx##_##sy##_O, ray_slope_##sx##_##sy##_P
+#define RAY_SLOPE_ENTRY_YZ(sx) RAY_SLOPE_ENTRY_Z(sx, M), RAY_SLOPE_ENTRY_Z(sx, O), RAY_SLOPE_ENTRY_Z(sx, P)
+
+// indexed by ray3.classification
+static const ray_slope_fn ray_slope_table[RAY_CLASSES] = {
+  RAY_SLOPE_ENTRY_YZ(M), RAY_SLOPE_ENTRY_YZ(O), RAY_SLOPE_ENTRY_YZ(P)
+};
+
+// same answer as ray_isect for a ray set up with ray3_init, `t` is the
+// entry distance (negative when the origin is inside)
+static inline int ray_slope_isect(const ray3 *r, const aabb b, float *t) {
+  return ray_slope_table[r->classification](r, b, t);
+}
+
+// 4 rays of one class against a box, structure of arrays like
+// ray_packet3. rays of mixed classes are tested one by one
+typedef struct {
+  vec3 origin[3];
+  vec3 invdir[3];
+  vec3 slope[6];
+  vec3 offset[6];
+  // shared by all 4 rays, -1 when they differ
+  int classification;
+  ray3 rays[4];
+} ray_slope_packet;
+
+static void ray_slope_packet_init(ray_slope_packet *packet, const ray3 *rays) {
+  packet->classification = rays[0].classification;
+  for (int i=0; i<4; i++) {
+    packet->rays[i] = rays[i];
+    if (rays[i].classification != packet->classification) {
+      packet->classification = -1;
+    }
+
+    for (int k=0; k<3; k++) {
+      packet->origin[k][i] = rays[i].origin[k];
+      packet->invdir[k][i] = rays[i].invdir[k];
+    }
+
+    for (int p=0; p<6; p++) {
+      packet->slope[p][i] = rays[i].slope[p];
+      packet->offset[p][i] = rays[i].offset[p];
+    }
+  }
+}
+
+typedef int ray_vi4 __attribute__((vector_size(16)));
+
+static inline __attribute__((always_inline)) int ray_slope_packet_test(
+  const ray_slope_packet *packet,
+  const aabb b,
+  vec3 *t,
+  const int sx,
+  const int sy,
+  const int sz
+) {
+  const int sign[3] = { sx, sy, sz };
+  ray_vi4 miss = {0};
+
+  for (int k=0; k<3; k++) {
+    if (sign[k] <= 0) {
+      miss |= (ray_vi4)(packet->origin[k] < vec3f(b[0][k]));
+    }
+    if (sign[k] >= 0) {
+      miss |= (ray_vi4)(packet->origin[k] > vec3f(b[1][k]));
+    }
+  }
+
+  for (int p=0; p<6; p++) {
+    const int a = ray_pair_a[p], c = ray_pair_b[p];
+    if (!sign[a] || !sign[c]) {
+      continue;
+    }
+
+    vec3 at = packet->slope[p] * vec3f(sign[a] < 0 ? b[0][a] : b[1][a]) + packet->offset[p];
+    miss |= (ray_vi4)(sign[c] > 0 ? at < vec3f(b[0][c]) : at > vec3f(b[1][c]));
+  }
+
+  vec3 tnear = vec3f(sx || sy || sz ? -FLT_MAX : 0.0f);
+  for (int k=0; k<3; k++) {
+    if (sign[k]) {
+      vec3 tk = (vec3f(sign[k] > 0 ? b[0][k] : b[1][k]) - packet->origin[k]) * packet->invdir[k];
+      tnear = _mm_max_ps(tk, tnear);
+    }
+  }
+  *t = tnear;
+  return ~_mm_movemask_ps((__m128)miss) & 0xF;
+}
+
+typedef int (*ray_slope_packet_fn)(const ray_slope_packet *, const aabb, vec3 *);
+
+#define RAY_SLOPE_PACKET_DEFINE(sx, sy, sz) \
+static int ray_slope_packet_##sx##_##sy##_##sz(const ray_slope_packet *packet, const aabb b, vec3 *t) { \
+  return ray_slope_packet_test(packet, b, t, RAY_SIGN_##sx, RAY_SIGN_##sy, RAY_SIGN_##sz); \
+}
+
+#define RAY_SLOPE_PACKET_DEFINE_Z(sx, sy) \
+  RAY_SLOPE_PACKET_DEFINE(sx, sy, M) \
+  RAY_SLOPE_PACKET_DEFINE(sx, sy, O) \
+  RAY_SLOPE_PACKET_DEFINE(sx, sy, P)
+
+#define RAY_SLOPE_PACKET_DEFINE_YZ(sx) \
+  RAY_SLOPE_PACKET_DEFINE_Z(sx, M) \
+  RAY_SLOPE_PACKET_DEFINE_Z(sx, O) \
+  RAY_SLOPE_PACKET_DEFINE_Z(sx, P)
+
+RAY_SLOPE_PACKET_DEFINE_YZ(M)
+RAY_SLOPE_PACKET_DEFINE_YZ(O)
+RAY_SLOPE_PACKET_DEFINE_YZ(P)
+
+#define RAY_SLOPE_PACKET_ENTRY_Z(sx, sy) \
+  ray_slope_packet_##sx##_##sy##_M, ray_slope_packet_##sx##_##sy##_O, ray_slope_packet_##sx##_##sy##_P
+#define RAY_SLOPE_PACKET_ENTRY_YZ(sx) \
+  RAY_SLOPE_PACKET_ENTRY_Z(sx, M), RAY_SLOPE_PACKET_ENTRY_Z(sx, O), RAY_SLOPE_PACKET_ENTRY_Z(sx, P)
+
+static const ray_slope_packet_fn ray_slope_packet_table[RAY_CLASSES] = {
+  RAY_SLOPE_PACKET_ENTRY_YZ(M), RAY_SLOPE_PACKET_ENTRY_YZ(O), RAY_SLOPE_PACKET_ENTRY_YZ(P)
+};
+
+// hit mask of the 4 rays, their entry distances in `t`
+static inline int ray_slope_packet_isect(const ray_slope_packet *packet, const aabb b, vec3 *t) {
+  if (packet->classification >= 0) {
+    return ray_slope_packet_table[packet->classification](packet, b, t);
+  }
+
+  int out = 0;
+  for (int i=0; i<4; i++) {
+    float ti = 0.0f;
+    if (ray_slope_isect(&packet->rays[i], b, &ti)) {
+      out |= 1 << i;
+    }
+    (*t)[i] = ti;
+  }
+  return out;
+}
+
 #endif
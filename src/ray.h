@@ -4,6 +4,15 @@
 #include "vec.h"
 #include <immintrin.h>
 
+// ray slope classes (Eisemann & Magnor): the sign of each direction
+// component, -1, 0 or 1, picks one of 27 specialized box tests
+#define RAY_CLASSES 27
+#define RAY_CLASS(sx, sy, sz) (((sx) + 1) * 9 + ((sy) + 1) * 3 + ((sz) + 1))
+
+// axis pairs (a, b) of the slopes, in the order xy yx xz zx yz zy
+static const int ray_pair_a[6] = { 0, 1, 0, 2, 1, 2 };
+static const int ray_pair_b[6] = { 1, 0, 2, 0, 2, 1 };
+
 typedef struct ray_t
 {
   //common variables
@@ -11,8 +20,33 @@ typedef struct ray_t
   vec3 origin;
   // ray slope
   int classification;
+  vec3 dir;
+  // per axis pair (a, b): dir[b] / dir[a] and where the ray's projection
+  // crosses a = 0, origin[b] - slope * origin[a]. the paper's jbyi and
+  // c_xy for (x, y)
+  float slope[6];
+  float offset[6];
 } ray3;
 
+static inline int ray_sign(const float v) {
+  return v > 0.0f ? 1 : (v < 0.0f ? -1 : 0);
+}
+
+// everything the slab and the slope tests need, once per ray
+static void ray3_init(ray3 *r, const vec3 origin, const vec3 dir) {
+  r->origin = origin;
+  r->dir = dir;
+  r->invdir = vec3f(1.0f) / dir;
+  r->classification = RAY_CLASS(ray_sign(dir[0]), ray_sign(dir[1]), ray_sign(dir[2]));
+
+  for (int p=0; p<6; p++) {
+    const int a = ray_pair_a[p], b = ray_pair_b[p];
+    // pairs with a flat axis are never tested
+    r->slope[p] = dir[a] != 0.0f && dir[b] != 0.0f ? dir[b] / dir[a] : 0.0f;
+    r->offset[p] = origin[b] - r->slope[p] * origin[a];
+  }
+}
+
 typedef struct ray_packet_t {
   // stored as [0]=x, [1]=y, [2]=z
   vec3 invdir[4];
@@ -0,0 +1,577 @@
+#ifndef __RENDER__
+#define __RENDER__
+  #include <stdint.h>
+  #include <string.h>
+  #include <time.h>
+  #include <thpool.h>
+  #include "vec.h"
+  #include "ray.h"
+  #include "ray-aabb.h"
+  #include "orbit-camera.h"
+  #include "world.h"
+  #include "isa.h"
+
+  static double render_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  // renders the `width` x `height` pixels at `x,y` of the screen, `x` must
+  // be a multiple of 4
+  typedef struct {
+    uint8_t *data;
+    int x;
+    int y;
+    int width;
+    int height;
+    int screen_width, screen_height;
+    // bytes per pixel: 3 (RGB) or 4 (RGBA, a packet is one or two vector
+    // stores)
+    int stride;
+    int render_id;
+    vec3 pos;
+    vec3 dcol;
+    vec3 drow;
+    vec3 ro;
+    vec4 color;
+    voxel_world world;
+    // the part of `world` the area's rays can reach (see voxel_world_cull),
+    // NULL when they miss every brick
+    voxel_world visible;
+  } screen_area;
+
+  // the widest packet render_screen_area_body walks
+  #define RENDER_PACKET_MAX 8
+
+  // `packet` (4 or 8) rays are walked and shaded together, a constant in
+  // every variant below
+  static inline __attribute__((always_inline)) void render_screen_area_body(void *args, const int packet) {
+    screen_area *c = (screen_area *)args;
+    int width = c->screen_width;
+    int right = c->x + c->width;
+    int bottom = c->y + c->height;
+    int stride = c->stride;
+
+    vec3 dcol, drow, ro, rd, row, normal, o;
+    dcol = c->dcol;
+    drow = c->drow;
+    ro = c->ro;
+    uint8_t *data = c->data;
+    vec3 dir[RAY_SPAN], ndir[RENDER_PACKET_MAX];
+    ray_span span;
+    float tnear[RAY_SPAN] __attribute__((aligned(64)));
+    float tvisible[RAY_SPAN] __attribute__((aligned(64)));
+    float tstart[RENDER_PACKET_MAX];
+    float r = VOXEL_BRICK_HALF_SIZE * 0.99f;
+    int result, walk, found, lanes, spanned, entered;
+    voxel_world_hit hits[RENDER_PACKET_MAX];
+    uint32_t pixels[RENDER_PACKET_MAX];
+    int x, y;
+
+    // world bounds relative to the eye, min xyz then max xyz, and the
+    // bounds of what the area can see, where the walks start
+    float box[6], visible[6];
+    // rays entering the world this close to 2 faces of its box are on an
+    // edge, the same band as the edges of a brick
+    vec3 center = aabb_center(c->world->bounds);
+    vec3 edge = (c->world->bounds[1] - c->world->bounds[0]) * vec3f(0.5f) - vec3f(VOXEL_BRICK_HALF_SIZE - r);
+    for (int k=0; k<3; k++) {
+      box[k] = c->world->bounds[0][k] - ro[k];
+      box[k + 3] = c->world->bounds[1][k] - ro[k];
+      if (c->visible) {
+        visible[k] = c->visible->bounds[0][k] - ro[k];
+        visible[k + 3] = c->visible->bounds[1][k] - ro[k];
+      }
+    }
+
+    for (y=c->y; y<bottom; ++y) {
+      // every direction comes straight from its pixel coordinates, not
+      // from stepping along the row, so it is the same whatever tile the
+      // pixel falls in
+      row = c->pos + dcol * vec3f(y) - ro;
+      for (int sx=c->x; sx<right; sx+=RAY_SPAN) {
+        // the bounds test runs over the whole span at the widest width the
+        // cpu has, traversal and shading go a packet at a time
+        int count = right - sx < RAY_SPAN ? right - sx : RAY_SPAN;
+        count = (count + packet - 1) & ~(packet - 1);
+
+        for (int i=0; i<count; i++) {
+          rd = row + drow * vec3f(sx + i + 1);
+          dir[i] = rd;
+          // exact, the entry distances start the walks
+          vec3 invdir = vec3f(1.0f) / rd;
+          span.invdir[0][i] = invdir[0];
+          span.invdir[1][i] = invdir[1];
+          span.invdir[2][i] = invdir[2];
+        }
+
+        spanned = ray_isect_span(&span, box, count, tnear);
+        entered = spanned && c->visible ? ray_isect_span(&span, visible, count, tvisible) : 0;
+
+        for (x=sx; x<sx + count; x+=packet) {
+          // the last packet of a row may hang over the edge of the area
+          lanes = (1 << (right - x >= packet ? packet : right - x)) - 1;
+          result = (spanned >> (x - sx)) & lanes;
+          walk = (entered >> (x - sx)) & result;
+
+          // walk the packet's rays through the world together, each from
+          // where it enters the visible bounds
+          for (int j=0; j<packet; j++) {
+            float len = vec3_len(dir[x - sx + j]);
+            ndir[j] = vec3_norm(dir[x - sx + j]);
+            tstart[j] = tvisible[x - sx + j] > 0.0f ? tvisible[x - sx + j] * len : 0.0f;
+          }
+
+          if (!walk) {
+            found = 0;
+          } else if (packet == 8) {
+            found = voxel_world_traverse_packet8(c->visible, walk, ro, ndir, tstart, 1.0f, hits);
+          } else {
+            found = voxel_world_traverse_packet4(c->visible, walk, ro, ndir, tstart, 1.0f, hits);
+          }
+
+          for (int j=0; j<packet; j++) {
+            if (!(lanes & (1<<j))) {
+              break;
+            }
+
+            int cr = (int)(((x+j)/(float)width) * 255);
+            int cg = (int)((y/(float)c->screen_height) * 255);
+            int cb = 0;
+            int dark = 0;
+
+            if (found & (1<<j)) {
+              o = hits[j].entry - hits[j].brick->center;
+
+              for (int k=0; k<3; k++) {
+                if (fabsf(o[k]) >= r) {
+                  normal[k] = o[k] > 0.0f ? 1.0f : -1.0f;
+                } else {
+                  normal[k] = 0.0f;
+                }
+              }
+
+              float sum = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+
+              cr = (int)((hits[j].voxel[0] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
+              cg = (int)((hits[j].voxel[1] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
+              cb = (int)((hits[j].voxel[2] / (float)VOXEL_BRICK_WIDTH) * 255.0f);
+
+              dark = sum >= 2;
+            } else if (result & (1<<j)) {
+              // entered the world but hit nothing: darker, and darker still
+              // where it entered along an edge of the world's box
+              float tworld = tnear[x - sx + j] > 0.0f ? tnear[x - sx + j] : 0.0f;
+              o = ro + dir[x - sx + j] * vec3f(tworld) - center;
+              int edges = 0;
+              for (int k=0; k<3; k++) {
+                edges += fabsf(o[k]) >= edge[k];
+              }
+              dark = 1 + (edges >= 2);
+            }
+
+            for (; dark; dark--) {
+              cr = cr > 20 ? cr - 20 : 0;
+              cg = cg > 20 ? cg - 20 : 0;
+              cb = cb > 20 ? cb - 20 : 0;
+            }
+            pixels[j] = (uint32_t)cr | ((uint32_t)cg << 8) | ((uint32_t)cb << 16) | 0xFF000000u;
+          }
+
+          uint8_t *out = data + ((unsigned long)y * width + x) * stride;
+          if (stride == 4 && lanes == (1 << packet) - 1) {
+            // constant size, one or two vector stores
+            memcpy(out, pixels, packet * 4);
+          } else if (stride == 4) {
+            memcpy(out, pixels, __builtin_popcount(lanes) * 4);
+          } else {
+            for (int j=0; j<packet && (lanes & (1<<j)); j++) {
+              out[j*3 + 0] = (uint8_t)pixels[j];
+              out[j*3 + 1] = (uint8_t)(pixels[j] >> 8);
+              out[j*3 + 2] = (uint8_t)(pixels[j] >> 16);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // render_screen_area_body built once per instruction set. flatten pulls
+  // traversal, shading and the framebuffer write into each copy, so they
+  // are all compiled for it. avx2 and up walk 8 ray packets
+  #define RENDER_AREA_DEFINE(name, target, packet) \
+  target __attribute__((flatten)) static void render_screen_area_##name(void *args) { \
+    render_screen_area_body(args, packet); \
+  }
+
+  RENDER_AREA_DEFINE(baseline, , 4)
+  RENDER_AREA_DEFINE(sse42, ISA_TARGET_SSE42, 4)
+  RENDER_AREA_DEFINE(avx2, ISA_TARGET_AVX2, 8)
+  RENDER_AREA_DEFINE(avx512, ISA_TARGET_AVX512, 8)
+
+  static void render_screen_area_resolve(void *args);
+
+  // the variant for this cpu (see isa.h), picked on the first call
+  static void (*render_screen_area)(void *args) = render_screen_area_resolve;
+
+  static void render_screen_area_resolve(void *args) {
+    void (*fn)(void *) = render_screen_area_baseline;
+    switch (isa_level()) {
+      case ISA_SSE42: fn = render_screen_area_sse42; break;
+      case ISA_AVX2: fn = render_screen_area_avx2; break;
+      case ISA_AVX512: fn = render_screen_area_avx512; break;
+    }
+    __atomic_store_n(&render_screen_area, fn, __ATOMIC_RELAXED);
+    fn(args);
+  }
+
+  // camera basis shared by every area of a frame, rows and columns are
+  // interpolated from 3 unprojected points
+  typedef struct {
+    vec3 ro, pos, dcol, drow;
+  } render_view;
+
+  static void render_view_create(render_view *out, mat4 view, mat4 projection, const int width, const int height) {
+    mat4 m4inverted;
+    out->ro = mat4_get_eye(view);
+
+    mat4_mul(m4inverted, projection, view);
+    mat4_invert(m4inverted, m4inverted);
+
+    vec3 t0 = vec3_create(0, 0, 0), tx = vec3_create(1, 0, 0), ty = vec3_create(0, 1, 0);
+    vec4 viewport = { 0, 0, width, height };
+
+    vec3 rda = orbit_camera_unproject(t0, viewport, m4inverted);
+    vec3 rdb = orbit_camera_unproject(tx, viewport, m4inverted);
+    out->pos = orbit_camera_unproject(ty, viewport, m4inverted);
+    out->dcol = out->pos - rda;
+    out->drow = rdb - rda;
+  }
+
+  // The frame is cut into square tiles, every worker owns a deque holding a
+  // contiguous run of them. Owners pop from the front, and once their own
+  // deque is empty they steal from the back of the others, so threads that
+  // drew sky keep helping the ones stuck in dense geometry.
+
+  #define RENDER_TILE_SIZE 32
+
+  typedef struct {
+    // head in the low 32 bits, tail in the high ones. both ends move with a
+    // CAS on the pair, so a deque is never handed out twice
+    uint64_t range;
+    char pad[56];
+  } __attribute__((aligned(64))) render_deque;
+
+  struct render_tiles_t;
+
+  typedef struct {
+    struct render_tiles_t *tiles;
+    int id;
+    // numa node the worker runs on (-1 when unknown) and the copy of the
+    // world it reads, NULL for the one passed to render_frame
+    int node;
+    voxel_world world;
+    // per frame stats
+    double elapsed;
+    int rendered, stolen;
+  } render_worker;
+
+  typedef struct render_tiles_t {
+    int count;
+    int size;
+    int columns, rows;
+    // shared by every tile of the frame, only the rect changes
+    screen_area frame;
+    render_deque *deques;
+    render_worker *workers;
+    // bricks inside the whole frame, the tiles cull from these
+    voxel_world_list candidates;
+    // the thread calling render_frame works the first deque itself instead
+    // of waiting for the pool, which then only needs `count - 1` threads
+    int caller;
+  } *render_tiles, render_tiles_t;
+
+  // `count` workers splitting the frame into `size` wide square tiles, NULL
+  // when out of memory
+  static render_tiles render_tiles_create(const int count, const int size) {
+    render_tiles out = (render_tiles)malloc(sizeof(render_tiles_t));
+    if (!out) {
+      return NULL;
+    }
+
+    out->count = count < 1 ? 1 : count;
+    // tiles start on a packet boundary
+    out->size = size < 4 ? 4 : size & ~3;
+    out->columns = 0;
+    out->rows = 0;
+    out->caller = 0;
+    out->candidates = (voxel_world_list){ NULL, 0, 0 };
+    out->workers = (render_worker *)calloc(out->count, sizeof(render_worker));
+    if (!out->workers || posix_memalign((void **)&out->deques, 64, sizeof(render_deque) * out->count)) {
+      free(out->workers);
+      free(out);
+      return NULL;
+    }
+
+    for (int i=0; i<out->count; i++) {
+      out->deques[i].range = 0;
+      out->workers[i].tiles = out;
+      out->workers[i].id = i;
+      out->workers[i].node = -1;
+      out->workers[i].world = NULL;
+    }
+    return out;
+  }
+
+  // destroys the numa replicas made by render_tiles_place, the workers of
+  // a node share one
+  static void render_tiles_drop_replicas(render_tiles tiles) {
+    for (int i=0; i<tiles->count; i++) {
+      voxel_world replica = tiles->workers[i].world;
+      if (!replica) {
+        continue;
+      }
+
+      voxel_world_destroy(replica);
+      for (int j=i; j<tiles->count; j++) {
+        if (tiles->workers[j].world == replica) {
+          tiles->workers[j].world = NULL;
+        }
+      }
+    }
+  }
+
+  static void render_tiles_destroy(render_tiles tiles) {
+    render_tiles_drop_replicas(tiles);
+    voxel_world_list_destroy(&tiles->candidates);
+    free(tiles->deques);
+    free(tiles->workers);
+    free(tiles);
+  }
+
+  // spread `world` over the numa nodes the workers run on. `nodes[i]` is
+  // the node of worker i, -1 when it may run anywhere. `policy` is one of
+  // the NUMA_* modes, replicas are only made for nodes that have workers
+  static void render_tiles_place(render_tiles tiles, voxel_world world, const int policy, const int *nodes) {
+    voxel_world replicas[NUMA_MAX_NODES] = { NULL };
+
+    render_tiles_drop_replicas(tiles);
+    for (int i=0; i<tiles->count; i++) {
+      tiles->workers[i].node = nodes[i];
+    }
+
+    if (policy == NUMA_INTERLEAVE) {
+      voxel_world_place(world, -1);
+    }
+
+    if (policy != NUMA_REPLICATE) {
+      return;
+    }
+
+    for (int i=0; i<tiles->count; i++) {
+      int node = nodes[i];
+      if (node < 0) {
+        continue;
+      }
+
+      if (!replicas[node]) {
+        replicas[node] = voxel_world_clone(world, node);
+      }
+      tiles->workers[i].world = replicas[node];
+    }
+  }
+
+  static inline uint64_t render_deque_pack(const uint32_t head, const uint32_t tail) {
+    return ((uint64_t)tail << 32) | head;
+  }
+
+  // take a tile from the front (`steal` == 0) or the back of `deque`,
+  // returns -1 when it is empty
+  static inline int render_deque_take(render_deque *deque, const int steal) {
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+      uint32_t head = (uint32_t)range;
+      uint32_t tail = (uint32_t)(range >> 32);
+      if (head >= tail) {
+        return -1;
+      }
+
+      uint64_t next = steal ? render_deque_pack(head, tail - 1) : render_deque_pack(head + 1, tail);
+      if (__atomic_compare_exchange_n(&deque->range, &range, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return steal ? (int)(tail - 1) : (int)head;
+      }
+    }
+  }
+
+  static int render_tiles_next(render_tiles tiles, render_worker *worker) {
+    int tile = render_deque_take(&tiles->deques[worker->id], 0);
+    if (tile >= 0) {
+      return tile;
+    }
+
+    // victims on our own node first, their tiles are likely in our caches
+    // and their deque lines never cross the interconnect
+    for (int local=1; local>=0; local--) {
+      for (int i=1; i<tiles->count; i++) {
+        render_worker *victim = &tiles->workers[(worker->id + i) % tiles->count];
+        if ((victim->node == worker->node) != local) {
+          continue;
+        }
+
+        tile = render_deque_take(&tiles->deques[victim->id], 1);
+        if (tile >= 0) {
+          worker->stolen++;
+          return tile;
+        }
+      }
+    }
+    return -1;
+  }
+
+  // the beam holding every ray of `area`. pixel x,y is traced along
+  // pos + dcol*y + drow*(x + 1), the corners sit half a pixel outside the
+  // outermost rays
+  static void render_area_beam(const screen_area *area, voxel_world_beam *beam) {
+    vec3 corners[4];
+    float u[2] = { area->x + 0.5f, area->x + area->width + 0.5f };
+    float v[2] = { area->y - 0.5f, area->y + area->height - 0.5f };
+    for (int i=0; i<4; i++) {
+      int a = i == 1 || i == 2, b = i >= 2;
+      corners[i] = area->pos + area->dcol * vec3f(v[b]) + area->drow * vec3f(u[a]) - area->ro;
+    }
+    voxel_world_beam_create(beam, area->ro, corners);
+  }
+
+  static void render_worker_run(void *args) {
+    render_worker *worker = (render_worker *)args;
+    render_tiles tiles = worker->tiles;
+    double begin = render_time();
+    screen_area area = tiles->frame;
+    if (worker->world) {
+      area.world = worker->world;
+    }
+    voxel_world_t visible;
+    voxel_world_beam beam;
+    int tile;
+
+    while ((tile = render_tiles_next(tiles, worker)) >= 0) {
+      int tx = tile % tiles->columns;
+      int ty = tile / tiles->columns;
+
+      area.x = tx * tiles->size;
+      area.y = ty * tiles->size;
+      area.width = tiles->size;
+      area.height = tiles->size;
+      // tiles along the right and bottom edges may be partial
+      if (area.x + area.width > area.screen_width) {
+        area.width = area.screen_width - area.x;
+      }
+      if (area.y + area.height > area.screen_height) {
+        area.height = area.screen_height - area.y;
+      }
+
+      render_area_beam(&area, &beam);
+      area.visible = voxel_world_cull(area.world, &tiles->candidates, &beam, &visible) ? &visible : NULL;
+
+      render_screen_area(&area);
+      worker->rendered++;
+    }
+
+    worker->elapsed = render_time() - begin;
+  }
+
+  // hand the frame to one worker per tile deque on `pool` and return right
+  // away, render_frame_finish waits for it. with a NULL `pool` every tile
+  // is rendered here before returning
+  static void render_frame_start(
+    threadpool pool,
+    render_tiles tiles,
+    const render_view *view,
+    voxel_world world,
+    uint8_t *data,
+    const int width,
+    const int height,
+    const int stride
+  ) {
+    screen_area *frame = &tiles->frame;
+    frame->dcol = view->dcol;
+    frame->drow = view->drow;
+    frame->pos = view->pos;
+    frame->ro = view->ro;
+    frame->screen_width = width;
+    frame->screen_height = height;
+    frame->stride = stride;
+    frame->data = data;
+    frame->render_id = 0;
+    frame->world = world;
+    frame->visible = world;
+
+    // one pass over the world per frame, the tiles only look at what the
+    // whole screen can see
+    voxel_world_beam beam;
+    frame->x = 0;
+    frame->y = 0;
+    frame->width = width;
+    frame->height = height;
+    render_area_beam(frame, &beam);
+    voxel_world_list_build(world, &beam, &tiles->candidates);
+
+    tiles->columns = (width + tiles->size - 1) / tiles->size;
+    tiles->rows = (height + tiles->size - 1) / tiles->size;
+    int total = tiles->columns * tiles->rows;
+
+    // contiguous runs keep neighbouring tiles on the same worker
+    for (int i=0; i<tiles->count; i++) {
+      uint32_t head = (uint32_t)((long long)total * i / tiles->count);
+      uint32_t tail = (uint32_t)((long long)total * (i + 1) / tiles->count);
+      __atomic_store_n(&tiles->deques[i].range, render_deque_pack(head, tail), __ATOMIC_RELAXED);
+
+      tiles->workers[i].elapsed = 0.0;
+      tiles->workers[i].rendered = 0;
+      tiles->workers[i].stolen = 0;
+    }
+
+    if (!pool) {
+      for (int i=0; i<tiles->count; i++) {
+        render_worker_run(&tiles->workers[i]);
+      }
+      return;
+    }
+
+    // thpool_add_work publishes the deques to the workers
+    for (int i=tiles->caller; i<tiles->count; i++) {
+      thpool_add_work(pool, (void *)render_worker_run, (void *)&tiles->workers[i]);
+    }
+  }
+
+  // wait for the frame handed out by render_frame_start. a caller that
+  // renders (see render_tiles_t) works its deque, and steals, from here
+  static void render_frame_finish(threadpool pool, render_tiles tiles) {
+    if (!pool) {
+      return;
+    }
+
+    if (tiles->caller) {
+      render_worker_run(&tiles->workers[0]);
+    }
+    thpool_wait(pool);
+  }
+
+  // render the whole frame with one worker per tile deque on `pool` (and
+  // the caller, see render_tiles_t), or every tile on the calling thread
+  // when `pool` is NULL
+  static void render_frame(
+    threadpool pool,
+    render_tiles tiles,
+    const render_view *view,
+    voxel_world world,
+    uint8_t *data,
+    const int width,
+    const int height,
+    const int stride
+  ) {
+    render_frame_start(pool, tiles, view, world, data, width, height, stride);
+    render_frame_finish(pool, tiles);
+  }
+#endif
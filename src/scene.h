@@ -0,0 +1,78 @@
+#ifndef __SCENE__
+#define __SCENE__
+  #include <thpool.h>
+  #include "voxel.h"
+  #include "world.h"
+
+  static float brick_fill(const unsigned int x, const unsigned int y, const unsigned int z) {
+    if (x == VOXEL_BRICK_HALF_WIDTH ||
+        y == VOXEL_BRICK_HALF_WIDTH ||
+        z == VOXEL_BRICK_HALF_WIDTH
+    ) {
+      return 100.0f;
+    }
+
+    float dx = x - VOXEL_BRICK_HALF_WIDTH;
+    float dy = y - VOXEL_BRICK_HALF_WIDTH;
+    float dz = z - VOXEL_BRICK_HALF_WIDTH;
+
+    float d = sqrtf(dx*dx + dy*dy + dz*dz);
+    if (d < VOXEL_BRICK_HALF_WIDTH) {
+      return 100.0f;
+    }
+    return 0.0f;
+  }
+
+  // same shape as brick_fill, a whole z row at a time
+  static void brick_fill_row(const unsigned int x, const unsigned int y, float *row) {
+    const float r2 = VOXEL_BRICK_HALF_WIDTH * VOXEL_BRICK_HALF_WIDTH;
+    const float dx = x - VOXEL_BRICK_HALF_WIDTH;
+    const float dy = y - VOXEL_BRICK_HALF_WIDTH;
+    const float dxy = dx*dx + dy*dy;
+    const int plane = x == VOXEL_BRICK_HALF_WIDTH || y == VOXEL_BRICK_HALF_WIDTH;
+
+    for (unsigned int z=0; z<VOXEL_BRICK_WIDTH; z++) {
+      float dz = z - VOXEL_BRICK_HALF_WIDTH;
+      row[z] = dxy + dz*dz < r2 ? 100.0f : 0.0f;
+    }
+
+    row[(int)VOXEL_BRICK_HALF_WIDTH] = 100.0f;
+    if (plane) {
+      for (unsigned int z=0; z<VOXEL_BRICK_WIDTH; z++) {
+        row[z] = 100.0f;
+      }
+    }
+  }
+
+  // the demo scene: 3x3 bricks, each a sphere cut by three planes. the
+  // bricks come from one pool so they sit next to each other in memory
+  static voxel_world scene_create(threadpool pool) {
+    static voxel_brick_pool bricks = NULL;
+    if (!bricks) {
+      bricks = voxel_brick_pool_create(VOXEL_BRICK_BITS, 1.0f, 0);
+    }
+
+    voxel_world world = voxel_world_create();
+    for (int bx=-1; bx<=1; bx++) {
+      for (int bz=-1; bz<=1; bz++) {
+        voxel_brick brick = voxel_brick_pool_alloc(bricks);
+        voxel_world_set(world, bx, 0, bz, brick);
+        voxel_brick_fill_rows(brick, pool, &brick_fill_row);
+      }
+    }
+    return world;
+  }
+
+  // the fixed camera path of bench and offscreen: once around the scene over
+  // `count` poses, rising and sinking twice on the way, always looking at its
+  // center
+  static void scene_orbit(mat4 view, const int pose, const int count) {
+    const float a = 2.0f * M_PI * pose / count;
+    vec3 eye = vec3_create(
+      VOXEL_BRICK_SIZE * 4 * sinf(a),
+      VOXEL_BRICK_SIZE * 2 * sinf(a * 2.0f),
+      VOXEL_BRICK_SIZE * 4 * cosf(a)
+    );
+    mat4_look_at(view, eye, vec3f(0.0f), vec3_create(0.0f, 1.0f, 0.0f));
+  }
+#endif
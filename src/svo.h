@@ -0,0 +1,275 @@
+#ifndef __SVO__
+#define __SVO__
+  #include <stdint.h>
+  #include <stdlib.h>
+  #include "vec.h"
+  #include "aabb.h"
+  #include "voxel.h"
+
+  // Sparse 64-tree covering one brick's worth of voxels. Every node splits
+  // its region into 4^3 children, so a 256^3 volume is three node levels
+  // (64^3, 16^3 and 4^3 voxel children) over 4^3 voxel leaves stored as a
+  // single 64 bit occupancy mask. Children of a node are packed in popcount
+  // order, only occupied ones are stored.
+
+  #define VOXEL_SVO_DEPTH 3
+
+  typedef struct {
+    // one bit per child, x major like the linear voxel layout
+    uint64_t mask;
+    // index of the first child in `nodes`, or in `leaves` at the last level
+    uint32_t children;
+    uint32_t pad;
+  } voxel_svo_node;
+
+  typedef struct {
+    // nodes[0] is the root
+    voxel_svo_node *nodes;
+    unsigned int node_count, node_capacity;
+    uint64_t *leaves;
+    unsigned int leaf_count, leaf_capacity;
+    vec3 center;
+    aabb bounds;
+  } *voxel_svo, voxel_svo_t;
+
+  typedef int (*voxel_svo_sample_t)(void *ctx, const unsigned int x, const unsigned int y, const unsigned int z);
+
+  // shift of the child coordinate at each node level
+  static inline int voxel_svo_shift(const int level) {
+    return 6 - 2 * level;
+  }
+
+  static inline unsigned int voxel_svo_child(const int x, const int y, const int z, const int shift) {
+    return (((x >> shift) & 3) << 4) | (((y >> shift) & 3) << 2) | ((z >> shift) & 3);
+  }
+
+  static unsigned int voxel_svo_push_nodes(voxel_svo svo, const voxel_svo_node *nodes, const unsigned int count) {
+    if (svo->node_count + count > svo->node_capacity) {
+      while (svo->node_count + count > svo->node_capacity) {
+        svo->node_capacity *= 2;
+      }
+      svo->nodes = (voxel_svo_node *)realloc(svo->nodes, sizeof(voxel_svo_node) * svo->node_capacity);
+    }
+
+    unsigned int start = svo->node_count;
+    memcpy(svo->nodes + start, nodes, sizeof(voxel_svo_node) * count);
+    svo->node_count += count;
+    return start;
+  }
+
+  static unsigned int voxel_svo_push_leaves(voxel_svo svo, const uint64_t *leaves, const unsigned int count) {
+    if (svo->leaf_count + count > svo->leaf_capacity) {
+      while (svo->leaf_count + count > svo->leaf_capacity) {
+        svo->leaf_capacity *= 2;
+      }
+      svo->leaves = (uint64_t *)realloc(svo->leaves, sizeof(uint64_t) * svo->leaf_capacity);
+    }
+
+    unsigned int start = svo->leaf_count;
+    memcpy(svo->leaves + start, leaves, sizeof(uint64_t) * count);
+    svo->leaf_count += count;
+    return start;
+  }
+
+  static uint64_t voxel_svo_build_leaf(voxel_svo_sample_t sample, void *ctx, const int x, const int y, const int z) {
+    uint64_t mask = 0;
+    for (int i=0; i<64; i++) {
+      if (sample(ctx, x + (i >> 4), y + ((i >> 2) & 3), z + (i & 3))) {
+        mask |= 1ULL << i;
+      }
+    }
+    return mask;
+  }
+
+  // builds the node covering the region at `x,y,z` on `level`, appending its
+  // children to the tree
+  static voxel_svo_node voxel_svo_build_node(
+    voxel_svo svo,
+    voxel_svo_sample_t sample,
+    void *ctx,
+    const int level,
+    const int x,
+    const int y,
+    const int z
+  ) {
+    const int size = 1 << voxel_svo_shift(level);
+    voxel_svo_node out = { 0, 0, 0 };
+    voxel_svo_node nodes[64];
+    uint64_t leaves[64];
+    unsigned int count = 0;
+
+    for (int i=0; i<64; i++) {
+      int cx = x + (i >> 4) * size;
+      int cy = y + ((i >> 2) & 3) * size;
+      int cz = z + (i & 3) * size;
+
+      if (level == VOXEL_SVO_DEPTH - 1) {
+        uint64_t leaf = voxel_svo_build_leaf(sample, ctx, cx, cy, cz);
+        if (leaf) {
+          leaves[count++] = leaf;
+          out.mask |= 1ULL << i;
+        }
+      } else {
+        voxel_svo_node node = voxel_svo_build_node(svo, sample, ctx, level + 1, cx, cy, cz);
+        if (node.mask) {
+          nodes[count++] = node;
+          out.mask |= 1ULL << i;
+        }
+      }
+    }
+
+    if (level == VOXEL_SVO_DEPTH - 1) {
+      out.children = voxel_svo_push_leaves(svo, leaves, count);
+    } else {
+      out.children = voxel_svo_push_nodes(svo, nodes, count);
+    }
+    return out;
+  }
+
+  static voxel_svo voxel_svo_build(voxel_svo_sample_t sample, void *ctx) {
+    voxel_svo out = (voxel_svo)malloc(sizeof(voxel_svo_t));
+    out->node_capacity = 64;
+    out->leaf_capacity = 64;
+    out->nodes = (voxel_svo_node *)malloc(sizeof(voxel_svo_node) * out->node_capacity);
+    out->leaves = (uint64_t *)malloc(sizeof(uint64_t) * out->leaf_capacity);
+
+    // reserve the root slot so it stays at index 0
+    out->node_count = 1;
+    out->leaf_count = 0;
+    // building may grow (and move) `nodes`
+    voxel_svo_node root = voxel_svo_build_node(out, sample, ctx, 0, 0, 0, 0);
+    out->nodes[0] = root;
+    out->center = vec3f(0.0f);
+    out->bounds[0] = vec3f(-VOXEL_BRICK_HALF_SIZE);
+    out->bounds[1] = vec3f(VOXEL_BRICK_HALF_SIZE);
+    return out;
+  }
+
+  typedef struct {
+    set_callback_t cb;
+    float threshold;
+  } voxel_svo_callback_ctx;
+
+  static int voxel_svo_sample_callback(void *ctx, const unsigned int x, const unsigned int y, const unsigned int z) {
+    voxel_svo_callback_ctx *c = (voxel_svo_callback_ctx *)ctx;
+    return c->cb(x, y, z) > c->threshold;
+  }
+
+  typedef struct {
+    voxel_brick brick;
+    float density;
+  } voxel_svo_brick_ctx;
+
+  static int voxel_svo_sample_brick(void *ctx, const unsigned int x, const unsigned int y, const unsigned int z) {
+    voxel_svo_brick_ctx *c = (voxel_svo_brick_ctx *)ctx;
+    return voxel_brick_occupied(c->brick, x, y, z, c->density);
+  }
+
+  // voxels where `cb` returns a value above `threshold` are solid
+  static voxel_svo voxel_svo_create(set_callback_t cb, const float threshold) {
+    voxel_svo_callback_ctx ctx = { cb, threshold };
+    return voxel_svo_build(voxel_svo_sample_callback, &ctx);
+  }
+
+  // same occupancy (and placement) as `voxel_brick_traverse(brick, ..., density)`
+  static voxel_svo voxel_svo_from_brick(voxel_brick brick, const float density) {
+    voxel_svo_brick_ctx ctx = { brick, density };
+    voxel_svo out = voxel_svo_build(voxel_svo_sample_brick, &ctx);
+    out->center = brick->center;
+    out->bounds[0] = brick->bounds[0];
+    out->bounds[1] = brick->bounds[1];
+    return out;
+  }
+
+  static void voxel_svo_position(voxel_svo svo, const vec3 center) {
+    svo->center = center;
+    svo->bounds[0] = center - vec3f(VOXEL_BRICK_HALF_SIZE);
+    svo->bounds[1] = center + vec3f(VOXEL_BRICK_HALF_SIZE);
+  }
+
+  static void voxel_svo_destroy(voxel_svo svo) {
+    free(svo->nodes);
+    free(svo->leaves);
+    free(svo);
+  }
+
+  // short stack of the nodes containing the last looked up voxel
+  typedef struct {
+    const voxel_svo_node *node[VOXEL_SVO_DEPTH];
+    // voxel coordinates shifted down to each node's region
+    int key[VOXEL_SVO_DEPTH][3];
+    int depth;
+  } voxel_svo_stack;
+
+  // returns 1 when the voxel at `pos` is solid, otherwise `shift` is set to
+  // the size of the empty region around it (0 for a single voxel)
+  static inline int voxel_svo_lookup(voxel_svo svo, voxel_svo_stack *stack, const int *pos, int *shift) {
+    // pop back up to the deepest node that still contains `pos`
+    while (stack->depth > 1) {
+      int s = voxel_svo_shift(stack->depth - 2);
+      int *key = stack->key[stack->depth - 1];
+      if ((pos[0] >> s) == key[0] && (pos[1] >> s) == key[1] && (pos[2] >> s) == key[2]) {
+        break;
+      }
+      stack->depth--;
+    }
+
+    const voxel_svo_node *node = stack->node[stack->depth - 1];
+    for (int level = stack->depth - 1; level < VOXEL_SVO_DEPTH; level++) {
+      int s = voxel_svo_shift(level);
+      unsigned int bit = voxel_svo_child(pos[0], pos[1], pos[2], s);
+
+      if (!((node->mask >> bit) & 1)) {
+        *shift = s;
+        return 0;
+      }
+
+      unsigned int child = node->children + __builtin_popcountll(node->mask & ((1ULL << bit) - 1));
+      if (level == VOXEL_SVO_DEPTH - 1) {
+        *shift = 0;
+        return (svo->leaves[child] >> voxel_svo_child(pos[0], pos[1], pos[2], 0)) & 1;
+      }
+
+      node = &svo->nodes[child];
+      stack->node[level + 1] = node;
+      stack->key[level + 1][0] = pos[0] >> s;
+      stack->key[level + 1][1] = pos[1] >> s;
+      stack->key[level + 1][2] = pos[2] >> s;
+      stack->depth = level + 2;
+    }
+    return 0;
+  }
+
+  // same contract as voxel_brick_traverse, `isect` is where the ray enters
+  // the svo bounds and `out` receives the hit voxel
+  static int voxel_svo_traverse(
+    voxel_svo svo,
+    const vec3 isect,
+    const vec3 rd,
+    int *out
+  ) {
+    voxel_dda dda;
+    voxel_dda_init(&dda, (isect - svo->bounds[0]) * vec3f(1.0f / VOXEL_SIZE), rd);
+
+    voxel_svo_stack stack;
+    stack.node[0] = &svo->nodes[0];
+    stack.depth = 1;
+    int shift = 0;
+
+    while (voxel_dda_inside(&dda)) {
+      if (voxel_svo_lookup(svo, &stack, dda.pos, &shift)) {
+        out[0] = dda.pos[0];
+        out[1] = dda.pos[1];
+        out[2] = dda.pos[2];
+        return 1;
+      }
+
+      if (shift) {
+        voxel_dda_skip(&dda, shift);
+      } else {
+        voxel_dda_step(&dda);
+      }
+    }
+    return 0;
+  }
+#endif
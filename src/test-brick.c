@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "ray.h"
+#include "ray-aabb.h"
+#include "voxel.h"
+#include "vec.h"
+#include "test.h"
+
+// a single voxel in the middle of an otherwise empty brick, found by a
+// diagonal ray from outside, for dense and bit storage. and fills on a
+// pool, also one started from a job on that pool, match a serial fill
+
+// traces the diagonal through `brick` (placed with its min corner on the
+// origin), returns whether a voxel was found and writes it to `out`
+static int test_diagonal(voxel_brick brick, int *out) {
+  ray3 r;
+  ray3_init(&r, vec3f(-0.5f), vec3f(1.0f));
+
+  float t = 0;
+  if (!TEST_CHECK(ray_isect(&r, brick->bounds, &t))) {
+    return 0;
+  }
+
+  vec3 isect = r.origin + r.dir * vec3f(t);
+  return voxel_brick_traverse(brick, isect, vec3_norm(r.dir), 1.0f, out);
+}
+
+static void test_brick(voxel_brick brick) {
+  const int middle = VOXEL_BRICK_HALF_WIDTH - 1;
+  int voxel[3] = { -1, -1, -1 };
+
+  voxel_brick_position(brick, vec3f(VOXEL_BRICK_HALF_SIZE));
+  voxel_brick_fill_constant(brick, 0.0f);
+  TEST_CHECK(!test_diagonal(brick, voxel));
+
+  voxel_brick_set(brick, middle, middle, middle, 100.0f);
+  TEST_CHECK(test_diagonal(brick, voxel));
+  TEST_CHECK(voxel[0] == middle && voxel[1] == middle && voxel[2] == middle);
+
+  // a solid brick stops the ray on the voxel it enters through
+  voxel_brick_fill_constant(brick, 100.0f);
+  TEST_CHECK(test_diagonal(brick, voxel));
+  TEST_CHECK(voxel[0] == 0 && voxel[1] == 0 && voxel[2] == 0);
+
+  voxel_brick_destroy(brick);
+}
+
+static float test_ball(const unsigned int x, const unsigned int y, const unsigned int z) {
+  float dx = (float)x - VOXEL_BRICK_HALF_WIDTH;
+  float dy = (float)y - VOXEL_BRICK_HALF_WIDTH;
+  float dz = (float)z - VOXEL_BRICK_HALF_WIDTH;
+  return sqrtf(dx*dx + dy*dy + dz*dz) < VOXEL_BRICK_HALF_WIDTH * 0.75f ? 100.0f : 0.0f;
+}
+
+static int test_same(voxel_brick a, voxel_brick b) {
+  return (
+    !memcmp(a->occupancy, b->occupancy, sizeof(uint64_t) * VOXEL_BRICK_WORDS) &&
+    !memcmp(a->cells_l1, b->cells_l1, sizeof(a->cells_l1)) &&
+    a->cells_l2 == b->cells_l2
+  );
+}
+
+typedef struct {
+  voxel_brick brick;
+  threadpool pool;
+} test_nested;
+
+static void test_nested_fill(void *arg) {
+  test_nested *nested = (test_nested *)arg;
+  voxel_brick_fill_parallel(nested->brick, nested->pool, test_ball);
+}
+
+static void test_fill() {
+  threadpool pool = thpool_init(3);
+  voxel_brick expect = voxel_brick_create_bits(1.0f, 0);
+  voxel_brick_fill(expect, test_ball);
+
+  voxel_brick brick = voxel_brick_create_bits(1.0f, 0);
+  voxel_brick_fill_parallel(brick, pool, test_ball);
+  TEST_CHECK(test_same(brick, expect));
+
+  // a fill from inside a pool job while this thread fills on the same pool
+  test_nested nested = { voxel_brick_create_bits(1.0f, 0), pool };
+  thpool_add_work(pool, (void *)test_nested_fill, (void *)&nested);
+  voxel_brick_fill_parallel(brick, pool, test_ball);
+  thpool_wait(pool);
+  TEST_CHECK(test_same(brick, expect));
+  TEST_CHECK(test_same(nested.brick, expect));
+
+  thpool_destroy(pool);
+  voxel_brick_destroy(nested.brick);
+  voxel_brick_destroy(brick);
+  voxel_brick_destroy(expect);
+}
+
+int main() {
+  test_brick(voxel_brick_create());
+  test_brick(voxel_brick_create_bits(1.0f, 0));
+  test_fill();
+  return test_done("brick");
+}
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "ray.h"
+#include "ray-aabb.h"
+#include "voxel.h"
+#include "voxel-packet.h"
+#include "vec.h"
+#include "isa.h"
+#include "test.h"
+
+// bundles of rays from a shared origin into a brick, every lane of the
+// packet walks must land on the voxel the scalar walk finds
+
+#define TEST_RAYS 20000
+
+// a hollow sphere around the center with a sprinkle of single voxels, so
+// rays hit both large empty cells and lone voxels
+static float test_fill(const unsigned int x, const unsigned int y, const unsigned int z) {
+  float dx = (float)x - VOXEL_BRICK_HALF_WIDTH;
+  float dy = (float)y - VOXEL_BRICK_HALF_WIDTH;
+  float dz = (float)z - VOXEL_BRICK_HALF_WIDTH;
+  float d = sqrtf(dx*dx + dy*dy + dz*dz);
+
+  if (d > VOXEL_BRICK_HALF_WIDTH * 0.5f && d < VOXEL_BRICK_HALF_WIDTH * 0.6f) {
+    return 100.0f;
+  }
+
+  return (x * 7 + y * 13 + z * 29) % 4099 == 0 ? 100.0f : 0.0f;
+}
+
+// compares the lanes in `mask` of a packet result against the scalar walk
+static void test_lanes(const int mask, const int found, const int *out, const int *expect, const int *hit) {
+  for (int i=0; i<8; i++) {
+    if (!((mask >> i) & 1)) {
+      continue;
+    }
+
+    TEST_CHECK(((found >> i) & 1) == hit[i]);
+    if (hit[i]) {
+      TEST_CHECK(!memcmp(out + i*3, expect + i*3, sizeof(int) * 3));
+    }
+  }
+}
+
+int main() {
+  voxel_brick bricks[2] = { voxel_brick_create(), voxel_brick_create_bits(1.0f, 0) };
+
+  for (int b=0; b<2; b++) {
+    voxel_brick brick = bricks[b];
+    voxel_brick_position(brick, vec3f(0.0f));
+    voxel_brick_fill(brick, test_fill);
+
+    for (int n=0; n<TEST_RAYS; n++) {
+      vec3 origin = vec3_create(test_random(1.0f), test_random(1.0f), test_random(1.0f));
+      vec3 isect[8], rd[8];
+      int expect[24], hit[8] = {0}, mask = 0;
+
+      for (int i=0; i<8; i++) {
+        vec3 target = vec3_create(
+          test_random(VOXEL_BRICK_HALF_SIZE),
+          test_random(VOXEL_BRICK_HALF_SIZE),
+          test_random(VOXEL_BRICK_HALF_SIZE)
+        );
+        rd[i] = vec3_norm(target - origin);
+
+        // axis aligned rays take the step-less path
+        if (n % 7 == 0) {
+          rd[i][n % 3] = 0.0f;
+          rd[i] = vec3_norm(rd[i]);
+        }
+
+        ray3 r;
+        ray3_init(&r, origin, rd[i]);
+
+        float t = 0;
+        isect[i] = origin;
+        if (ray_isect(&r, brick->bounds, &t)) {
+          mask |= 1 << i;
+          isect[i] = origin + rd[i] * vec3f(t > 0.0f ? t : 0.0f);
+          hit[i] = voxel_brick_traverse(brick, isect[i], rd[i], 1.0f, expect + i*3);
+        }
+      }
+
+      int out[24];
+      for (int h=0; h<8; h+=4) {
+        const int lanes = (mask >> h) & 15;
+        int found = voxel_brick_traverse_packet4(brick, lanes, isect + h, rd + h, 1.0f, out + h*3);
+        test_lanes(lanes << h, found << h, out, expect, hit);
+      }
+
+      // the 8 wide walk is built for avx2
+      if (isa_level() >= ISA_AVX2) {
+        int found = voxel_brick_traverse_packet8(brick, mask, isect, rd, 1.0f, out);
+        test_lanes(mask, found, out, expect, hit);
+      }
+    }
+  }
+
+  return test_done("packet");
+}
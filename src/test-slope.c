@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "ray.h"
+#include "ray-aabb.h"
+#include "vec.h"
+#include "test.h"
+
+// the ray slope box tests (ray_slope_isect, ray_slope_packet_isect) give
+// the same hits and entry distances as the slab test ray_isect, for every
+// one of the 27 direction classes
+
+#define TEST_PACKETS 500000
+
+static vec3 test_direction() {
+  vec3 d = vec3_create(test_random(1.0f), test_random(1.0f), test_random(1.0f));
+  // flat components, every class shows up
+  for (int k=0; k<3; k++) {
+    if (test_random(1.0f) < -0.5f) {
+      d[k] = 0.0f;
+    }
+  }
+  return d;
+}
+
+// how far inside the box the ray stays, in double precision and relative to
+// its exit distance, negative for a miss. rays grazing an edge or corner
+// within float rounding may go either way
+static double test_margin(const ray3 *r, const aabb box) {
+  double tmin = 0.0, tmax = 1e300;
+  for (int k=0; k<3; k++) {
+    double o = r->origin[k], d = r->dir[k];
+    if (d == 0.0) {
+      if (o < box[0][k] || o > box[1][k]) {
+        return -1.0;
+      }
+      continue;
+    }
+
+    double t1 = (box[0][k] - o) / d, t2 = (box[1][k] - o) / d;
+    tmin = fmax(tmin, fmin(t1, t2));
+    tmax = fmin(tmax, fmax(t1, t2));
+  }
+  return (tmax - tmin) / (1.0 + fabs(tmax));
+}
+
+int main() {
+  int classes[RAY_CLASSES] = { 0 };
+  int hits = 0, mixed = 0;
+
+  for (int i=0; i<TEST_PACKETS && test_failures < 10; i++) {
+    aabb box;
+    for (int k=0; k<3; k++) {
+      float a = test_random(4.0f), b = test_random(4.0f);
+      box[0][k] = a < b ? a : b;
+      box[1][k] = a < b ? b : a;
+    }
+
+    // most packets share a class, like neighbouring camera rays do
+    ray3 rays[4];
+    vec3 shared = test_direction();
+    for (int j=0; j<4; j++) {
+      vec3 dir = i % 4 ? shared : test_direction();
+      // back from a point around the box, so about half the rays hit
+      vec3 target = aabb_center(box) + (box[1] - box[0]) * vec3_create(
+        test_random(0.6f),
+        test_random(0.6f),
+        test_random(0.6f)
+      );
+      ray3_init(&rays[j], target - dir * vec3f(test_random(8.0f)), dir);
+    }
+
+    ray_slope_packet packet;
+    ray_slope_packet_init(&packet, rays);
+    vec3 tpacket;
+    int mask = ray_slope_packet_isect(&packet, box, &tpacket);
+    mixed += packet.classification < 0;
+
+    for (int j=0; j<4; j++) {
+      ray3 *r = &rays[j];
+      // no direction at all, nothing to test against
+      if (r->classification == RAY_CLASS(0, 0, 0)) {
+        continue;
+      }
+      classes[r->classification]++;
+
+      float tslab = 0.0f, tslope = 0.0f;
+      int slab = ray_isect(r, box, &tslab);
+      int slope = ray_slope_isect(r, box, &tslope);
+
+      // a flat ray lying in a face plane touches the (closed) box, the slab
+      // test computes 0 * inf there and misses it
+      int plane = 0;
+      for (int k=0; k<3; k++) {
+        plane |= r->dir[k] == 0.0f && (r->origin[k] == box[0][k] || r->origin[k] == box[1][k]);
+      }
+
+      double margin = test_margin(r, box);
+      if (fabs(margin) > 1e-5) {
+        TEST_CHECK(slope == (margin > 0.0));
+        TEST_CHECK(slab == slope || plane);
+      }
+      TEST_CHECK(((mask >> j) & 1) == slope);
+      if (slab && slope) {
+        TEST_CHECK(tslab == tslope);
+        TEST_CHECK(tpacket[j] == tslope);
+      }
+      hits += slope;
+    }
+  }
+
+  printf("%i hits, %i mixed packets\n", hits, mixed);
+  for (int c=0; c<RAY_CLASSES; c++) {
+    if (c != RAY_CLASS(0, 0, 0)) {
+      TEST_CHECK(classes[c] > 0);
+    }
+  }
+  TEST_CHECK(hits > 0 && mixed > 0);
+  return test_done("slope");
+}
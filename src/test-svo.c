@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "ray.h"
+#include "ray-aabb.h"
+#include "voxel.h"
+#include "svo.h"
+#include "vec.h"
+#include "scene.h"
+#include "test.h"
+
+// the 64-tree answers the brick ray query: a brick and a tree built from
+// the same callback (and a tree built from the brick) report the same hit
+// voxel for every ray
+
+#define TEST_RAYS 200000
+
+// a few scattered voxels, far apart, so most rays cross long empty runs
+// and every level of both hierarchies gets skipped
+static float test_sparse(const unsigned int x, const unsigned int y, const unsigned int z) {
+  return (x * 7 + y * 13 + z * 29) % 4099 == 0 && (x ^ y ^ z) & 1 ? 2.0f : 0.0f;
+}
+
+// traces random rays from around the brick at it, returns how many hit
+static int test_rays(voxel_brick brick, voxel_svo a, voxel_svo b) {
+  int hits = 0;
+  for (int i=0; i<TEST_RAYS; i++) {
+    vec3 ro = vec3_create(test_random(1.0f), test_random(1.0f), test_random(1.0f));
+    // aim at a random point of the brick so most rays enter it
+    vec3 target = vec3_create(
+      test_random(VOXEL_BRICK_HALF_SIZE),
+      test_random(VOXEL_BRICK_HALF_SIZE),
+      test_random(VOXEL_BRICK_HALF_SIZE)
+    );
+    vec3 rd = vec3_norm(target - ro);
+
+    // axis aligned rays too, they take the flat DDA paths
+    if (i % 16 == 0) {
+      rd[i / 16 % 3] = 0.0f;
+      rd = vec3_norm(rd);
+    }
+
+    ray3 r;
+    ray3_init(&r, ro, rd);
+    float t = 0;
+    if (!ray_isect(&r, brick->bounds, &t)) {
+      continue;
+    }
+
+    vec3 isect = ro + rd * vec3f(t > 0.0f ? t : 0.0f);
+    int expect[3], va[3], vb[3];
+    int found = voxel_brick_traverse(brick, isect, rd, 1.0f, expect);
+    int found_a = voxel_svo_traverse(a, isect, rd, va);
+    int found_b = voxel_svo_traverse(b, isect, rd, vb);
+
+    TEST_CHECK(found == found_a && found == found_b);
+    if (found && found_a && found_b) {
+      TEST_CHECK(va[0] == expect[0] && va[1] == expect[1] && va[2] == expect[2]);
+      TEST_CHECK(vb[0] == expect[0] && vb[1] == expect[1] && vb[2] == expect[2]);
+    }
+    hits += found;
+
+    if (test_failures > 10) {
+      break;
+    }
+  }
+  return hits;
+}
+
+static void test_scene(set_callback_t cb, const char *name) {
+  voxel_brick brick = voxel_brick_create_bits(1.0f, 0);
+  voxel_brick_position(brick, vec3f(0.0f));
+  voxel_brick_fill(brick, cb);
+
+  voxel_svo a = voxel_svo_create(cb, 1.0f);
+  voxel_svo b = voxel_svo_from_brick(brick, 1.0f);
+  TEST_CHECK(a->node_count == b->node_count && a->leaf_count == b->leaf_count);
+
+  int hits = test_rays(brick, a, b);
+  printf("%s: %i of %i rays hit, %u nodes, %u leaves\n", name, hits, TEST_RAYS, a->node_count, a->leaf_count);
+  // both outcomes were exercised
+  TEST_CHECK(hits > 0 && hits < TEST_RAYS);
+
+  voxel_svo_destroy(a);
+  voxel_svo_destroy(b);
+  voxel_brick_destroy(brick);
+}
+
+int main() {
+  test_scene(brick_fill, "scene");
+  test_scene(test_sparse, "sparse");
+  return test_done("svo");
+}
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "ray.h"
+#include "ray-aabb.h"
+#include "voxel.h"
+#include "world.h"
+#include "vec.h"
+#include "isa.h"
+#include "scene.h"
+#include "test.h"
+
+// the 4 and 8 wide packet walks through the world (the ones the render
+// variants use) find the same brick and voxel as voxel_world_traverse for
+// every lane, whatever the other lanes of the packet do
+
+#define TEST_PACKETS 20000
+
+// checks `w` lanes of `rd` from `ro` through `world` against the scalar
+// walk, returns how many hit
+static int test_packet(voxel_world world, const vec3 ro, const vec3 *rd, const int w) {
+  voxel_world_hit expect[8], hits[8];
+  float tstart[8];
+  int found = 0, mask = 0;
+
+  for (int j=0; j<w; j++) {
+    voxel_world_walk walk;
+    // the renderer starts the walks where the span test enters the bounds,
+    // the same distance walk_init finds
+    if (voxel_world_walk_init(world, &walk, ro, rd[j])) {
+      mask |= 1<<j;
+      tstart[j] = walk.t;
+    }
+    found |= voxel_world_traverse(world, ro, rd[j], 1.0f, &expect[j]) << j;
+  }
+
+  int result = w == 8
+    ? voxel_world_traverse_packet8(world, mask, ro, rd, tstart, 1.0f, hits)
+    : voxel_world_traverse_packet4(world, mask, ro, rd, tstart, 1.0f, hits);
+
+  TEST_CHECK(result == found);
+  for (int j=0; j<w; j++) {
+    if (result & found & (1<<j)) {
+      TEST_CHECK(hits[j].brick == expect[j].brick);
+      TEST_CHECK(
+        hits[j].voxel[0] == expect[j].voxel[0] &&
+        hits[j].voxel[1] == expect[j].voxel[1] &&
+        hits[j].voxel[2] == expect[j].voxel[2]
+      );
+    }
+  }
+  return __builtin_popcount(found);
+}
+
+static void test_world(voxel_world world, const int w) {
+  int hits = 0;
+  for (int i=0; i<TEST_PACKETS && test_failures < 10; i++) {
+    // a camera somewhere around the world, its rays fanning out over a
+    // small patch like a packet of neighbouring pixels
+    const float size = VOXEL_BRICK_SIZE;
+    vec3 ro = vec3_create(test_random(4.0f * size), test_random(4.0f * size), test_random(4.0f * size));
+    vec3 target = vec3_create(test_random(1.5f * size), test_random(0.5f * size), test_random(1.5f * size));
+    float spread = i % 2 ? VOXEL_SIZE : 0.25f * size;
+
+    vec3 rd[8];
+    for (int j=0; j<w; j++) {
+      rd[j] = vec3_norm(target + vec3_create(test_random(spread), test_random(spread), test_random(spread)) - ro);
+    }
+    hits += test_packet(world, ro, rd, w);
+  }
+
+  printf("%i wide: %i of %i rays hit\n", w, hits, TEST_PACKETS * w);
+  TEST_CHECK(hits > 0 && hits < TEST_PACKETS * w);
+}
+
+int main() {
+  voxel_world world = scene_create(NULL);
+
+  // setting an occupied cell hands back the brick it displaces
+  voxel_brick middle = voxel_world_get(world, 0, 0, 0);
+  voxel_brick other = voxel_brick_create_bits(1.0f, 0);
+  voxel_brick_fill(other, brick_fill);
+  TEST_CHECK(voxel_world_set(world, 0, 0, 0, other) == middle);
+  TEST_CHECK(voxel_world_get(world, 0, 0, 0) == other && world->count == 9);
+  voxel_brick_destroy(middle);
+
+  test_world(world, 4);
+  // the 8 wide brick walk is built for avx2
+  if (isa_level() >= ISA_AVX2) {
+    test_world(world, 8);
+  }
+  return test_done("world");
+}
@@ -0,0 +1,40 @@
+#ifndef __TEST__
+#define __TEST__
+  #include <stdio.h>
+  #include <stdint.h>
+
+  // checks for the test targets (see CMakeLists.txt). a failed check is
+  // printed and the test keeps going, main returns test_done()
+
+  static int test_failures = 0;
+
+  #define TEST_CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+  static int test_check(const int ok, const char *what, const char *file, const int line) {
+    if (!ok) {
+      fprintf(stderr, "%s:%i: check failed: %s\n", file, line, what);
+      test_failures++;
+    }
+    return ok;
+  }
+
+  // every run draws the same numbers from a fixed seed, so a failure
+  // reproduces. uniform in [-range, range]
+  static uint32_t test_seed = 2463534242u;
+
+  static float test_random(const float range) {
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 17;
+    test_seed ^= test_seed << 5;
+    return ((float)(test_seed >> 8) / (1 << 24) * 2.0f - 1.0f) * range;
+  }
+
+  static int test_done(const char *name) {
+    if (test_failures) {
+      fprintf(stderr, "%s: %i checks failed\n", name, test_failures);
+      return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+  }
+#endif
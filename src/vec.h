@@ -69,7 +69,13 @@ static inline vec3 vec3f(const float x) {
 
 
 static inline float vec3_len(vec3 const v) {
+#ifdef __SSE4_1__
   return _mm_cvtss_f32(_mm_sqrt_ss(_mm_dp_ps(v, v, 0x71)));
+#else
+  // same sum order as dpps, (x + y) + z
+  vec3 m = v * v;
+  return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(m[0] + m[1] + m[2])));
+#endif
 }
 
 static inline float vec3_distance(vec3 const a, vec3 const b) {
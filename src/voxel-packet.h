@@ -0,0 +1,174 @@
+#ifndef __VOXEL_PACKET__
+#define __VOXEL_PACKET__
+  #include <float.h>
+  #include <immintrin.h>
+  #include "vec.h"
+  #include "voxel.h"
+  #include "isa.h"
+
+  // lock-step DDA over 4 (SSE) or 8 (AVX2) rays through a brick, the same
+  // walk as voxel_brick_traverse with a per-lane active mask. the 8 wide
+  // walk is always built, callers check isa_level before using it
+
+  typedef float voxel_vf4 __attribute__((vector_size(16)));
+  typedef int voxel_vi4 __attribute__((vector_size(16)));
+
+  static inline int voxel_vi4_mask(const voxel_vi4 m) {
+    return _mm_movemask_ps((__m128)m);
+  }
+
+  typedef float voxel_vf8 __attribute__((vector_size(32)));
+  typedef int voxel_vi8 __attribute__((vector_size(32)));
+
+  ISA_TARGET_AVX2 static inline int voxel_vi8_mask(const voxel_vi8 m) {
+    return _mm256_movemask_ps((__m256)m);
+  }
+
+  #define VOXEL_SELECT_I(m, a, b) (((m) & (a)) | (~(m) & (b)))
+  #define VOXEL_SELECT_F(vi, m, a, b) ((__typeof__(a))VOXEL_SELECT_I(m, (vi)(a), (vi)(b)))
+
+  // voxel memory is read one lane at a time through the scalar accessors so
+  // every storage mode and layout is handled in one place
+  #define VOXEL_PACKET_DEFINE(w, target) \
+  target static int voxel_brick_traverse_packet##w( \
+    voxel_brick brick, \
+    const int mask, \
+    const vec3 *isect, \
+    const vec3 *rd, \
+    const float density, \
+    int *out \
+  ) { \
+    voxel_vf##w p[3], d[3], tmax[3], tfirst[3], tdelta[3], slope[3]; \
+    voxel_vi##w pos[3], step[3], count[3], active, shift, hit = {0}; \
+    const int skip = brick->storage == VOXEL_BRICK_BITS || density >= brick->threshold; \
+    int i, k; \
+    \
+    for (i=0; i<w; i++) { \
+      active[i] = (mask >> i) & 1 ? -1 : 0; \
+      for (k=0; k<3; k++) { \
+        p[k][i] = (isect[i][k] - brick->bounds[0][k]) * (1.0f / VOXEL_SIZE); \
+        d[k][i] = rd[i][k]; \
+      } \
+    } \
+    \
+    for (k=0; k<3; k++) { \
+      voxel_vi##w f = __builtin_convertvector(p[k], voxel_vi##w); \
+      f += __builtin_convertvector(f, voxel_vf##w) > p[k]; \
+      f = VOXEL_SELECT_I(f < 0, 0, f); \
+      pos[k] = VOXEL_SELECT_I(f >= VOXEL_BRICK_WIDTH, VOXEL_BRICK_WIDTH - 1, f); \
+      \
+      voxel_vi##w positive = d[k] > 0.0f; \
+      voxel_vi##w negative = d[k] < 0.0f; \
+      voxel_vf##w fpos = __builtin_convertvector(pos[k], voxel_vf##w); \
+      slope[k] = VOXEL_SELECT_F(voxel_vi##w, negative, -d[k], d[k]); \
+      step[k] = (positive & 1) | negative; \
+      tdelta[k] = VOXEL_SELECT_F(voxel_vi##w, positive | negative, 1.0f / slope[k], (voxel_vf##w){} + FLT_MAX); \
+      tmax[k] = VOXEL_SELECT_F( \
+        voxel_vi##w, \
+        positive, \
+        (fpos + 1.0f - p[k]) * tdelta[k], \
+        VOXEL_SELECT_F(voxel_vi##w, negative, (p[k] - fpos) * tdelta[k], tdelta[k]) \
+      ); \
+      tfirst[k] = tmax[k]; \
+      count[k] = (voxel_vi##w){0}; \
+    } \
+    \
+    for (;;) { \
+      active &= \
+        (pos[0] >= 0) & (pos[0] < VOXEL_BRICK_WIDTH) & \
+        (pos[1] >= 0) & (pos[1] < VOXEL_BRICK_WIDTH) & \
+        (pos[2] >= 0) & (pos[2] < VOXEL_BRICK_WIDTH); \
+      \
+      if (!voxel_vi##w##_mask(active)) { \
+        break; \
+      } \
+      \
+      voxel_vi##w occupied = {0}; \
+      for (i=0; i<w; i++) { \
+        shift[i] = 0; \
+        if (!active[i]) { \
+          continue; \
+        } \
+        \
+        if (skip && (shift[i] = voxel_brick_empty_cell(brick, pos[0][i], pos[1][i], pos[2][i]))) { \
+          continue; \
+        } \
+        \
+        if (voxel_brick_occupied(brick, pos[0][i], pos[1][i], pos[2][i], density)) { \
+          occupied[i] = -1; \
+        } \
+      } \
+      \
+      hit |= occupied; \
+      active &= ~occupied; \
+      \
+      /* lanes sitting in an empty cell jump to its far side */ \
+      voxel_vi##w skipping = active & (shift != 0); \
+      voxel_vi##w walking = active & (shift == 0); \
+      voxel_vi##w jump[3] = { {0}, {0}, {0} }; \
+      if (voxel_vi##w##_mask(skipping)) { \
+        voxel_vi##w size = VOXEL_SELECT_I(shift == VOXEL_CELL_L2_SHIFT, 1 << VOXEL_CELL_L2_SHIFT, 1 << VOXEL_CELL_L1_SHIFT); \
+        voxel_vi##w n[3]; \
+        voxel_vf##w texit[3]; \
+        for (k=0; k<3; k++) { \
+          voxel_vi##w lo = pos[k] & ~(size - 1); \
+          n[k] = VOXEL_SELECT_I(step[k] > 0, lo + size - pos[k], pos[k] - lo + 1); \
+          texit[k] = tfirst[k] + __builtin_convertvector(count[k] + n[k] - 1, voxel_vf##w) * tdelta[k]; \
+        } \
+        \
+        voxel_vf##w tcell = VOXEL_SELECT_F(voxel_vi##w, texit[1] < texit[0], texit[1], texit[0]); \
+        tcell = VOXEL_SELECT_F(voxel_vi##w, texit[2] < tcell, texit[2], tcell); \
+        \
+        /* ties go to the higher axis, like voxel_dda_step */ \
+        voxel_vi##w s2 = (texit[2] <= texit[0]) & (texit[2] <= texit[1]); \
+        voxel_vi##w s1 = ~s2 & (texit[1] <= texit[0]); \
+        voxel_vi##w skip_axis[3] = { ~s2 & ~s1, s1, s2 }; \
+        voxel_vi##w later[3] = { {0}, skip_axis[0], skip_axis[0] | skip_axis[1] }; \
+        \
+        for (k=0; k<3; k++) { \
+          /* boundaries crossed before tcell, the estimate is settled with \
+             the exact tmax like voxel_dda_skip */ \
+          voxel_vf##w estimate = (tcell - tmax[k]) * slope[k]; \
+          voxel_vi##w m = VOXEL_SELECT_I(estimate > 0.0f, __builtin_convertvector(estimate, voxel_vi##w), 0); \
+          voxel_vf##w t = tfirst[k] + __builtin_convertvector(count[k] + m - 1, voxel_vf##w) * tdelta[k]; \
+          m += (m > 0) & ~((t < tcell) | ((t == tcell) & later[k])); \
+          t = tfirst[k] + __builtin_convertvector(count[k] + m, voxel_vf##w) * tdelta[k]; \
+          m -= (t < tcell) | ((t == tcell) & later[k]); \
+          jump[k] = VOXEL_SELECT_I(skip_axis[k], n[k], m); \
+        } \
+      } \
+      \
+      voxel_vi##w x0 = (tmax[0] < tmax[1]) & (tmax[0] < tmax[2]); \
+      voxel_vi##w x1 = ~(tmax[0] < tmax[1]) & (tmax[1] < tmax[2]); \
+      voxel_vi##w walk_axis[3] = { x0, x1, ~x0 & ~x1 }; \
+      \
+      for (k=0; k<3; k++) { \
+        /* walking lanes take a single step along their closest axis */ \
+        voxel_vi##w m = VOXEL_SELECT_I(skipping, jump[k], walking & walk_axis[k] & 1); \
+        m &= step[k] != 0; \
+        \
+        pos[k] += m * step[k]; \
+        count[k] += m; \
+        tmax[k] = VOXEL_SELECT_F( \
+          voxel_vi##w, \
+          m > 0, \
+          tfirst[k] + __builtin_convertvector(count[k], voxel_vf##w) * tdelta[k], \
+          tmax[k] \
+        ); \
+      } \
+    } \
+    \
+    for (i=0; i<w; i++) { \
+      if (hit[i]) { \
+        out[i*3 + 0] = pos[0][i]; \
+        out[i*3 + 1] = pos[1][i]; \
+        out[i*3 + 2] = pos[2][i]; \
+      } \
+    } \
+    return voxel_vi##w##_mask(hit); \
+  }
+
+  VOXEL_PACKET_DEFINE(4, )
+  VOXEL_PACKET_DEFINE(8, ISA_TARGET_AVX2)
+
+#endif
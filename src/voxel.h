@@ -1,57 +1,613 @@
 #ifndef __VOXEL__
 #define __VOXEL__
+  #include <stdint.h>
+  #include <stdlib.h>
   #include <string.h>
   #include <math.h>
   #include <float.h>
+  #include <immintrin.h>
+  #include <pthread.h>
+  #include <thpool.h>
   #include "vec.h"
   #include "aabb.h"
+  #include "numa.h"
+  #include "mem.h"
 
   #define VOXEL_BRICK_WIDTH 256
+  #define VOXEL_BRICK_WIDTH_SHIFT 8
   #define VOXEL_BRICK_HALF_WIDTH (VOXEL_BRICK_WIDTH/2.0f)
   #define VOXEL_SIZE 0.001f
   #define VOXEL_BRICK_HALF_SIZE (VOXEL_BRICK_HALF_WIDTH * VOXEL_SIZE)
   #define VOXEL_BRICK_SIZE (VOXEL_BRICK_WIDTH * VOXEL_SIZE)
 
+  #define VOXEL_BRICK_VOXELS (VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH)
+  #define VOXEL_BRICK_WORDS (VOXEL_BRICK_VOXELS / 64)
+
+  // coarse occupancy hierarchy used to skip empty space during traversal
+  // level 1: 8^3 voxel cells (32^3 of them), level 2: 64^3 voxel cells (4^3)
+  #define VOXEL_CELL_L1_SHIFT 3
+  #define VOXEL_CELL_L2_SHIFT 6
+  #define VOXEL_CELL_L1_WIDTH (VOXEL_BRICK_WIDTH >> VOXEL_CELL_L1_SHIFT)
+  #define VOXEL_CELL_L2_WIDTH (VOXEL_BRICK_WIDTH >> VOXEL_CELL_L2_SHIFT)
+  #define VOXEL_CELL_L1_WORDS ((VOXEL_CELL_L1_WIDTH * VOXEL_CELL_L1_WIDTH * VOXEL_CELL_L1_WIDTH) / 64)
+
+  // voxel memory layout, pick one with -DVOXEL_BRICK_LAYOUT=...
+  //   LINEAR: x*W*W + y*W + z, a step along x jumps W*W voxels
+  //   TILED: x major 8^3 tiles of x major voxels, a tile is one level 1 cell
+  //          and in bit storage a single 64 byte cache line
+  //   MORTON: z-order curve, locality at every scale
+  #define VOXEL_LAYOUT_LINEAR 0
+  #define VOXEL_LAYOUT_TILED 1
+  #define VOXEL_LAYOUT_MORTON 2
+
+  #ifndef VOXEL_BRICK_LAYOUT
+    #define VOXEL_BRICK_LAYOUT VOXEL_LAYOUT_TILED
+  #endif
+
   typedef float (*set_callback_t)(const unsigned int x, const unsigned int y, const unsigned int z);
+  // fills all VOXEL_BRICK_WIDTH values of the z row at `x,y` in one call
+  typedef void (*set_row_callback_t)(const unsigned int x, const unsigned int y, float *row);
 
-  typedef struct {
+  typedef enum {
+    // one float density per voxel (64MiB per brick)
+    VOXEL_BRICK_DENSE = 0,
+    // one occupancy bit per voxel (2MiB per brick) + optional attributes
+    VOXEL_BRICK_BITS
+  } voxel_brick_storage;
+
+  struct voxel_brick_pool_t;
+
+  typedef struct voxel_brick_s {
+    voxel_brick_storage storage;
     float *voxels;//[VOXEL_BRICK_WIDTH][VOXEL_BRICK_WIDTH][VOXEL_BRICK_WIDTH];
+    uint64_t *occupancy;
+    // optional per voxel attribute channel (e.g. material id), may be NULL
+    uint8_t *attributes;
+    // values above this are written as occupied into bit storage
+    float threshold;
+    // a set bit means the cell may contain a voxel above `threshold`
+    uint64_t cells_l1[VOXEL_CELL_L1_WORDS];
+    uint64_t cells_l2;
     vec3 center;
     aabb bounds;
     aabb_packet bounds_packet;
+    // pool the brick was taken from (NULL when allocated on its own) and
+    // the next free slot while it sits in the pool
+    struct voxel_brick_pool_t *pool;
+    struct voxel_brick_s *next;
   } *voxel_brick, voxel_brick_t;
 
-  void voxel_brick_set(voxel_brick brick, const unsigned int x, const unsigned int y, const unsigned int z, float v) {
-    brick->voxels[x*VOXEL_BRICK_WIDTH*VOXEL_BRICK_WIDTH + y*VOXEL_BRICK_WIDTH + z] = v;
+  // every layout is separable: the index is the OR of one component per
+  // axis and each axis owns its own set of index bits
+  static inline unsigned int voxel_brick_axis(const unsigned int c, const int k) {
+#if VOXEL_BRICK_LAYOUT == VOXEL_LAYOUT_LINEAR
+    return c << (VOXEL_BRICK_WIDTH_SHIFT * (2 - k));
+#elif VOXEL_BRICK_LAYOUT == VOXEL_LAYOUT_TILED
+    const int tile_shift = VOXEL_BRICK_WIDTH_SHIFT - VOXEL_CELL_L1_SHIFT;
+    return (
+      ((c >> VOXEL_CELL_L1_SHIFT) << (3 * VOXEL_CELL_L1_SHIFT + tile_shift * (2 - k))) |
+      ((c & ((1 << VOXEL_CELL_L1_SHIFT) - 1)) << (VOXEL_CELL_L1_SHIFT * (2 - k)))
+    );
+#else
+    // spread the bits of `c` two apart
+    unsigned int v = c & 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v << (2 - k);
+#endif
+  }
+
+  static inline unsigned int voxel_brick_axis_mask(const int k) {
+    return voxel_brick_axis(VOXEL_BRICK_WIDTH - 1, k);
+  }
+
+  // move one axis component by +-1 without decoding it, the carry (or
+  // borrow) ripples through the bits owned by the other axes
+  static inline unsigned int voxel_brick_axis_step(const unsigned int a, const int k, const int step) {
+    const unsigned int mask = voxel_brick_axis_mask(k);
+    const unsigned int one = mask & -mask;
+    return (step > 0 ? (a | ~mask) + one : a - one) & mask;
+  }
+
+  static inline unsigned int voxel_brick_index(const unsigned int x, const unsigned int y, const unsigned int z) {
+    return voxel_brick_axis(x, 0) | voxel_brick_axis(y, 1) | voxel_brick_axis(z, 2);
+  }
+
+  static inline int voxel_brick_bit(voxel_brick brick, const unsigned int i) {
+    return (brick->occupancy[i >> 6] >> (i & 63)) & 1;
+  }
+
+  static inline unsigned int voxel_brick_cell_l1(const unsigned int x, const unsigned int y, const unsigned int z) {
+    return (
+      ((x >> VOXEL_CELL_L1_SHIFT) * VOXEL_CELL_L1_WIDTH + (y >> VOXEL_CELL_L1_SHIFT)) * VOXEL_CELL_L1_WIDTH +
+      (z >> VOXEL_CELL_L1_SHIFT)
+    );
+  }
+
+  static inline unsigned int voxel_brick_cell_l2(const unsigned int x, const unsigned int y, const unsigned int z) {
+    return (
+      ((x >> VOXEL_CELL_L2_SHIFT) * VOXEL_CELL_L2_WIDTH + (y >> VOXEL_CELL_L2_SHIFT)) * VOXEL_CELL_L2_WIDTH +
+      (z >> VOXEL_CELL_L2_SHIFT)
+    );
+  }
+
+  static inline void voxel_brick_mark_cells(voxel_brick brick, const unsigned int x, const unsigned int y, const unsigned int z) {
+    unsigned int c = voxel_brick_cell_l1(x, y, z);
+    brick->cells_l1[c >> 6] |= 1ULL << (c & 63);
+    brick->cells_l2 |= 1ULL << voxel_brick_cell_l2(x, y, z);
+  }
+
+  // returns the shift of the largest empty cell containing the voxel or 0
+  static inline int voxel_brick_empty_cell(voxel_brick brick, const unsigned int x, const unsigned int y, const unsigned int z) {
+    if (!((brick->cells_l2 >> voxel_brick_cell_l2(x, y, z)) & 1)) {
+      return VOXEL_CELL_L2_SHIFT;
+    }
+
+    unsigned int c = voxel_brick_cell_l1(x, y, z);
+    if (!((brick->cells_l1[c >> 6] >> (c & 63)) & 1)) {
+      return VOXEL_CELL_L1_SHIFT;
+    }
+    return 0;
+  }
+
+  static void voxel_brick_set(voxel_brick brick, const unsigned int x, const unsigned int y, const unsigned int z, float v) {
+    unsigned int i = voxel_brick_index(x, y, z);
+    // cells are only ever marked here, clearing a voxel leaves them
+    // conservatively occupied until the next fill
+    if (v > brick->threshold) {
+      voxel_brick_mark_cells(brick, x, y, z);
+    }
+
+    if (brick->storage == VOXEL_BRICK_BITS) {
+      uint64_t bit = 1ULL << (i & 63);
+      if (v > brick->threshold) {
+        brick->occupancy[i >> 6] |= bit;
+      } else {
+        brick->occupancy[i >> 6] &= ~bit;
+      }
+    } else {
+      brick->voxels[i] = v;
+    }
   }
 
-  voxel_brick voxel_brick_create() {
-    voxel_brick out = (voxel_brick)malloc(sizeof(voxel_brick_t));
-    // begin memory allocation
-//    out->voxels = malloc(
-    out->voxels = (float *)malloc(sizeof(float) * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH);
+  static void voxel_brick_clear_cells(voxel_brick brick, const int occupied) {
+    memset(brick->cells_l1, occupied ? 0xFF : 0, sizeof(brick->cells_l1));
+    brick->cells_l2 = occupied ? ~0ULL : 0;
+  }
 
+  static voxel_brick voxel_brick_create() {
+    voxel_brick out = (voxel_brick)mem_alloc(sizeof(voxel_brick_t));
+    out->storage = VOXEL_BRICK_DENSE;
+    out->pool = NULL;
+    out->next = NULL;
+    out->occupancy = NULL;
+    out->attributes = NULL;
+    out->threshold = 0.0f;
+    out->voxels = (float *)mem_alloc(sizeof(float) * VOXEL_BRICK_VOXELS);
+    voxel_brick_clear_cells(out, 0);
+    return out;
+  }
 
-    //    out->voxels = (float *)malloc(sizeof(float) * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH);
+  // occupancy only brick, voxels with a value above `threshold` are solid
+  static voxel_brick voxel_brick_create_bits(const float threshold, const int with_attributes) {
+    voxel_brick out = (voxel_brick)mem_alloc(sizeof(voxel_brick_t));
+    out->storage = VOXEL_BRICK_BITS;
+    out->pool = NULL;
+    out->next = NULL;
+    out->voxels = NULL;
+    out->threshold = threshold;
+    out->occupancy = (uint64_t *)mem_alloc(sizeof(uint64_t) * VOXEL_BRICK_WORDS);
+    out->attributes = with_attributes ? (uint8_t *)mem_alloc(sizeof(uint8_t) * VOXEL_BRICK_VOXELS) : NULL;
+    voxel_brick_clear_cells(out, 0);
     return out;
   }
 
-  void voxel_brick_fill_constant(voxel_brick brick, const float v) {
-    memset(brick->voxels, v, sizeof(float) * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH * VOXEL_BRICK_WIDTH);
+  // move the brick and its payload to numa `node`, or interleave them over
+  // every node when `node` < 0
+  static void voxel_brick_place(voxel_brick brick, const int node) {
+    numa_place(brick, sizeof(voxel_brick_t), node);
+    if (brick->voxels) {
+      numa_place(brick->voxels, sizeof(float) * VOXEL_BRICK_VOXELS, node);
+    }
+    if (brick->occupancy) {
+      numa_place(brick->occupancy, sizeof(uint64_t) * VOXEL_BRICK_WORDS, node);
+    }
+    if (brick->attributes) {
+      numa_place(brick->attributes, sizeof(uint8_t) * VOXEL_BRICK_VOXELS, node);
+    }
   }
 
-  static void voxel_brick_fill(voxel_brick brick, set_callback_t cb) {
-    for (unsigned int x=0; x<VOXEL_BRICK_WIDTH; x++) {
+  static void *voxel_brick_clone_array(const void *src, const size_t size, const int node) {
+    if (!src) {
+      return NULL;
+    }
+    // placed before the copy touches it, nothing has to migrate
+    void *out = mem_alloc(size);
+    numa_place(out, size, node);
+    memcpy(out, src, size);
+    return out;
+  }
+
+  // deep copy of `brick` living on numa `node`
+  static voxel_brick voxel_brick_clone(voxel_brick brick, const int node) {
+    voxel_brick out = (voxel_brick)numa_alloc(sizeof(voxel_brick_t), node);
+    *out = *brick;
+    out->pool = NULL;
+    out->next = NULL;
+    out->voxels = (float *)voxel_brick_clone_array(brick->voxels, sizeof(float) * VOXEL_BRICK_VOXELS, node);
+    out->occupancy = (uint64_t *)voxel_brick_clone_array(brick->occupancy, sizeof(uint64_t) * VOXEL_BRICK_WORDS, node);
+    out->attributes = (uint8_t *)voxel_brick_clone_array(brick->attributes, sizeof(uint8_t) * VOXEL_BRICK_VOXELS, node);
+    return out;
+  }
+
+  // Fixed slot brick allocator. Slots come in chunks of
+  // VOXEL_BRICK_POOL_CHUNK bricks, the structs of a chunk are one array and
+  // their payloads one contiguous huge page backed block, so neighbouring
+  // bricks sit next to each other in memory. Taking and returning a brick
+  // is a free list push/pop, returned payloads are discarded (reading as
+  // empty again) without touching them.
+
+  #define VOXEL_BRICK_POOL_CHUNK 8
+
+  typedef struct voxel_brick_pool_t {
+    voxel_brick_storage storage;
+    float threshold;
+    // payload bytes of one slot, split in voxels, occupancy and attributes
+    size_t voxels_size, occupancy_size, attributes_size, slot_size;
+    voxel_brick free;
+    pthread_mutex_t lock;
+    voxel_brick *structs;
+    uint8_t **payloads;
+    int chunk_count, chunk_capacity;
+  } *voxel_brick_pool, voxel_brick_pool_t;
+
+  // bricks with the storage of voxel_brick_create (VOXEL_BRICK_DENSE) or
+  // voxel_brick_create_bits(threshold, with_attributes)
+  static voxel_brick_pool voxel_brick_pool_create(
+    const voxel_brick_storage storage,
+    const float threshold,
+    const int with_attributes
+  ) {
+    voxel_brick_pool out = (voxel_brick_pool)malloc(sizeof(voxel_brick_pool_t));
+    out->storage = storage;
+    out->threshold = storage == VOXEL_BRICK_BITS ? threshold : 0.0f;
+    out->voxels_size = storage == VOXEL_BRICK_DENSE ? sizeof(float) * VOXEL_BRICK_VOXELS : 0;
+    out->occupancy_size = storage == VOXEL_BRICK_BITS ? sizeof(uint64_t) * VOXEL_BRICK_WORDS : 0;
+    out->attributes_size = storage == VOXEL_BRICK_BITS && with_attributes ? sizeof(uint8_t) * VOXEL_BRICK_VOXELS : 0;
+    out->slot_size = out->voxels_size + out->occupancy_size + out->attributes_size;
+    out->free = NULL;
+    pthread_mutex_init(&out->lock, NULL);
+    out->chunk_count = 0;
+    out->chunk_capacity = 4;
+    out->structs = (voxel_brick *)malloc(sizeof(voxel_brick) * out->chunk_capacity);
+    out->payloads = (uint8_t **)malloc(sizeof(uint8_t *) * out->chunk_capacity);
+    return out;
+  }
+
+  // adds a chunk of free slots, called with the lock held
+  static int voxel_brick_pool_grow(voxel_brick_pool pool) {
+    voxel_brick structs = (voxel_brick)mem_alloc(sizeof(voxel_brick_t) * VOXEL_BRICK_POOL_CHUNK);
+    uint8_t *payload = (uint8_t *)mem_alloc(pool->slot_size * VOXEL_BRICK_POOL_CHUNK);
+    if (!structs || !payload) {
+      mem_free(structs, sizeof(voxel_brick_t) * VOXEL_BRICK_POOL_CHUNK);
+      mem_free(payload, pool->slot_size * VOXEL_BRICK_POOL_CHUNK);
+      return 0;
+    }
+
+    if (pool->chunk_count == pool->chunk_capacity) {
+      pool->chunk_capacity *= 2;
+      pool->structs = (voxel_brick *)realloc(pool->structs, sizeof(voxel_brick) * pool->chunk_capacity);
+      pool->payloads = (uint8_t **)realloc(pool->payloads, sizeof(uint8_t *) * pool->chunk_capacity);
+    }
+    pool->structs[pool->chunk_count] = structs;
+    pool->payloads[pool->chunk_count] = payload;
+    pool->chunk_count++;
+
+    // pushed in reverse so slots are handed out in address order
+    for (int i=VOXEL_BRICK_POOL_CHUNK - 1; i>=0; i--) {
+      voxel_brick brick = &structs[i];
+      uint8_t *slot = payload + pool->slot_size * i;
+      brick->storage = pool->storage;
+      brick->threshold = pool->threshold;
+      brick->voxels = pool->voxels_size ? (float *)slot : NULL;
+      brick->occupancy = pool->occupancy_size ? (uint64_t *)(slot + pool->voxels_size) : NULL;
+      brick->attributes = pool->attributes_size ? slot + pool->voxels_size + pool->occupancy_size : NULL;
+      brick->pool = pool;
+      brick->next = pool->free;
+      pool->free = brick;
+    }
+    return 1;
+  }
+
+  // an empty brick, NULL when out of memory
+  static voxel_brick voxel_brick_pool_alloc(voxel_brick_pool pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->free && !voxel_brick_pool_grow(pool)) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+
+    voxel_brick out = pool->free;
+    pool->free = out->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    out->next = NULL;
+    voxel_brick_clear_cells(out, 0);
+    return out;
+  }
+
+  static void voxel_brick_pool_release(voxel_brick_pool pool, voxel_brick brick) {
+    // every slot is a whole number of huge pages, discarding is a madvise
+    // instead of a memset
+    mem_discard(brick->voxels ? (void *)brick->voxels : (void *)brick->occupancy, pool->slot_size);
+
+    pthread_mutex_lock(&pool->lock);
+    brick->next = pool->free;
+    pool->free = brick;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  // frees every chunk, bricks still taken from the pool become invalid
+  static void voxel_brick_pool_destroy(voxel_brick_pool pool) {
+    for (int i=0; i<pool->chunk_count; i++) {
+      mem_free(pool->structs[i], sizeof(voxel_brick_t) * VOXEL_BRICK_POOL_CHUNK);
+      mem_free(pool->payloads[i], pool->slot_size * VOXEL_BRICK_POOL_CHUNK);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->structs);
+    free(pool->payloads);
+    free(pool);
+  }
+
+  // returns a pooled brick to its pool, frees any other one
+  static void voxel_brick_destroy(voxel_brick brick) {
+    if (brick->pool) {
+      voxel_brick_pool_release(brick->pool, brick);
+      return;
+    }
+
+    mem_free(brick->voxels, sizeof(float) * VOXEL_BRICK_VOXELS);
+    mem_free(brick->occupancy, sizeof(uint64_t) * VOXEL_BRICK_WORDS);
+    mem_free(brick->attributes, sizeof(uint8_t) * VOXEL_BRICK_VOXELS);
+    mem_free(brick, sizeof(voxel_brick_t));
+  }
+
+  static void voxel_brick_fill_constant(voxel_brick brick, const float v) {
+    voxel_brick_clear_cells(brick, v > brick->threshold);
+    if (brick->storage == VOXEL_BRICK_BITS) {
+      memset(brick->occupancy, v > brick->threshold ? 0xFF : 0, sizeof(uint64_t) * VOXEL_BRICK_WORDS);
+      return;
+    }
+
+    for (unsigned int i=0; i<VOXEL_BRICK_VOXELS; i++) {
+      brick->voxels[i] = v;
+    }
+  }
+
+  // writes a whole z row and marks its cells, returns the level 2 cells
+  // touched. rows in different 8 wide x slabs never share a word, so slabs
+  // can be written concurrently
+  static uint64_t voxel_brick_set_row(voxel_brick brick, const unsigned int x, const unsigned int y, const float *row) {
+    const unsigned int i = voxel_brick_index(x, y, 0);
+    const __m128 threshold = _mm_set1_ps(brick->threshold);
+    uint32_t cells = 0;
+    uint64_t l2 = 0;
+
+    for (unsigned int w=0; w<VOXEL_BRICK_WIDTH/64; w++) {
+      uint64_t word = 0;
+      for (unsigned int j=0; j<64; j+=4) {
+        __m128 v = _mm_loadu_ps(row + w*64 + j);
+        word |= (uint64_t)_mm_movemask_ps(_mm_cmpgt_ps(v, threshold)) << j;
+      }
+
+      if (brick->storage == VOXEL_BRICK_BITS) {
+#if VOXEL_BRICK_LAYOUT == VOXEL_LAYOUT_LINEAR
+        brick->occupancy[(i >> 6) + w] = word;
+#elif VOXEL_BRICK_LAYOUT == VOXEL_LAYOUT_TILED
+        // every byte is the z run of a different tile
+        for (unsigned int b=0; b<8; b++) {
+          unsigned int t = voxel_brick_index(x, y, (w*8 + b) << VOXEL_CELL_L1_SHIFT);
+          ((uint8_t *)brick->occupancy)[t >> 3] = (uint8_t)(word >> (b*8));
+        }
+#else
+        for (unsigned int z=0; z<64; z++) {
+          unsigned int t = i | voxel_brick_axis(w*64 + z, 2);
+          uint64_t bit = 1ULL << (t & 63);
+          brick->occupancy[t >> 6] = (word >> z) & 1
+            ? brick->occupancy[t >> 6] | bit
+            : brick->occupancy[t >> 6] & ~bit;
+        }
+#endif
+      }
+
+      // every byte of `word` is one 8 voxel cell along z
+      for (unsigned int b=0; b<8; b++) {
+        if ((word >> (b*8)) & 0xFF) {
+          cells |= 1u << (w*8 + b);
+        }
+      }
+    }
+
+    if (brick->storage != VOXEL_BRICK_BITS) {
+#if VOXEL_BRICK_LAYOUT == VOXEL_LAYOUT_LINEAR
+      memcpy(brick->voxels + i, row, sizeof(float) * VOXEL_BRICK_WIDTH);
+#else
+      unsigned int iz = 0;
+      for (unsigned int z=0; z<VOXEL_BRICK_WIDTH; z++) {
+        brick->voxels[i | iz] = row[z];
+        iz = voxel_brick_axis_step(iz, 2, 1);
+      }
+#endif
+    }
+
+    if (cells) {
+      unsigned int c = voxel_brick_cell_l1(x, y, 0);
+      brick->cells_l1[c >> 6] |= (uint64_t)cells << (c & 63);
+
+      for (unsigned int z=0; z<VOXEL_CELL_L2_WIDTH; z++) {
+        if ((cells >> (z * (1 << (VOXEL_CELL_L2_SHIFT - VOXEL_CELL_L1_SHIFT)))) & 0xFF) {
+          l2 |= 1ULL << voxel_brick_cell_l2(x, y, z << VOXEL_CELL_L2_SHIFT);
+        }
+      }
+    }
+    return l2;
+  }
+
+  // one fill shared by the caller and its pool jobs. slabs (8 wide in x)
+  // are claimed one at a time, the caller works too and then waits for the
+  // slabs the jobs took. it never waits on the pool itself: thpool_wait
+  // allows one waiter, a frame may be rendering on the same pool, and a
+  // fill started from a pool job would wait for itself
+  typedef struct {
+    voxel_brick brick;
+    set_callback_t cb;
+    set_row_callback_t row_cb;
+    // next slab to claim and slabs filled
+    unsigned int next, done;
+    // the caller and every queued job, the last one out frees the fill.
+    // jobs that start after the brick is done find nothing to claim
+    int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+  } voxel_brick_fill_job;
+
+  static void voxel_brick_fill_slab(voxel_brick_fill_job *job, const unsigned int slab) {
+    float row[VOXEL_BRICK_WIDTH] __attribute__((aligned(16)));
+    uint64_t l2 = 0;
+
+    for (unsigned int x=slab << VOXEL_CELL_L1_SHIFT; x<(slab + 1) << VOXEL_CELL_L1_SHIFT; x++) {
       for (unsigned int y=0; y<VOXEL_BRICK_WIDTH; y++) {
-        for (unsigned int z=0; z<VOXEL_BRICK_WIDTH; z++) {
-          voxel_brick_set(brick, x, y, z, cb(x, y, z));
+        if (job->row_cb) {
+          job->row_cb(x, y, row);
+        } else {
+          for (unsigned int z=0; z<VOXEL_BRICK_WIDTH; z++) {
+            row[z] = job->cb(x, y, z);
+          }
         }
+        l2 |= voxel_brick_set_row(job->brick, x, y, row);
+      }
+    }
+
+    // the only word shared between slabs
+    __atomic_fetch_or(&job->brick->cells_l2, l2, __ATOMIC_RELAXED);
+  }
+
+  // fills slabs until none are left to claim
+  static void voxel_brick_fill_claim(voxel_brick_fill_job *job) {
+    unsigned int slab;
+    while ((slab = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < VOXEL_CELL_L1_WIDTH) {
+      voxel_brick_fill_slab(job, slab);
+
+      pthread_mutex_lock(&job->lock);
+      if (++job->done == VOXEL_CELL_L1_WIDTH) {
+        pthread_cond_signal(&job->filled);
+      }
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  static void voxel_brick_fill_release(voxel_brick_fill_job *job) {
+    if (!__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL)) {
+      pthread_mutex_destroy(&job->lock);
+      pthread_cond_destroy(&job->filled);
+      free(job);
+    }
+  }
+
+  static void voxel_brick_fill_worker(void *arg) {
+    voxel_brick_fill_claim((voxel_brick_fill_job *)arg);
+    voxel_brick_fill_release((voxel_brick_fill_job *)arg);
+  }
+
+  // fills every slab, helped by jobs on `pool` when it is not NULL. returns
+  // once the brick is filled, whatever else the pool is running
+  static void voxel_brick_fill_slabs(voxel_brick brick, threadpool pool, set_callback_t cb, set_row_callback_t row_cb) {
+    voxel_brick_fill_job local;
+    voxel_brick_fill_job *job = pool ? (voxel_brick_fill_job *)malloc(sizeof(voxel_brick_fill_job)) : NULL;
+    if (!job) {
+      job = &local;
+      pool = NULL;
+    }
+
+    job->brick = brick;
+    job->cb = cb;
+    job->row_cb = row_cb;
+    job->next = 0;
+    job->done = 0;
+    // the caller takes a slab too
+    job->refs = pool ? VOXEL_CELL_L1_WIDTH : 1;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->filled, NULL);
+
+    // rebuilt from scratch by voxel_brick_set_row
+    voxel_brick_clear_cells(brick, 0);
+
+    for (int i=1; pool && i<VOXEL_CELL_L1_WIDTH; i++) {
+      if (thpool_add_work(pool, (void *)voxel_brick_fill_worker, (void *)job)) {
+        voxel_brick_fill_release(job);
       }
     }
+    voxel_brick_fill_claim(job);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->done < VOXEL_CELL_L1_WIDTH) {
+      pthread_cond_wait(&job->filled, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (pool) {
+      voxel_brick_fill_release(job);
+    } else {
+      pthread_mutex_destroy(&job->lock);
+      pthread_cond_destroy(&job->filled);
+    }
+  }
+
+  static void voxel_brick_fill(voxel_brick brick, set_callback_t cb) {
+    voxel_brick_fill_slabs(brick, NULL, cb, NULL);
+  }
+
+  static void voxel_brick_fill_parallel(voxel_brick brick, threadpool pool, set_callback_t cb) {
+    voxel_brick_fill_slabs(brick, pool, cb, NULL);
+  }
+
+  // `cb` produces whole rows so generators can vectorize along z
+  static void voxel_brick_fill_rows(voxel_brick brick, threadpool pool, set_row_callback_t cb) {
+    voxel_brick_fill_slabs(brick, pool, NULL, cb);
   }
 
+  // bit storage returns 1.0f for occupied voxels and 0.0f for empty ones
   static float voxel_brick_get(voxel_brick brick, const int x, const int y, const int z) {
-    return brick->voxels[x*VOXEL_BRICK_WIDTH*VOXEL_BRICK_WIDTH + y*VOXEL_BRICK_WIDTH + z];
+    unsigned int i = voxel_brick_index(x, y, z);
+    if (brick->storage == VOXEL_BRICK_BITS) {
+      return voxel_brick_bit(brick, i) ? 1.0f : 0.0f;
+    }
+    return brick->voxels[i];
+  }
+
+  // bit storage has already applied its threshold, so `density` only
+  // affects dense bricks
+  static inline int voxel_brick_occupied_index(voxel_brick brick, const unsigned int i, const float density) {
+    if (brick->storage == VOXEL_BRICK_BITS) {
+      return voxel_brick_bit(brick, i);
+    }
+    return brick->voxels[i] > density;
+  }
+
+  static inline int voxel_brick_occupied(voxel_brick brick, const int x, const int y, const int z, const float density) {
+    return voxel_brick_occupied_index(brick, voxel_brick_index(x, y, z), density);
+  }
+
+  static inline void voxel_brick_set_attribute(voxel_brick brick, const unsigned int x, const unsigned int y, const unsigned int z, const uint8_t v) {
+    if (brick->attributes) {
+      brick->attributes[voxel_brick_index(x, y, z)] = v;
+    }
+  }
+
+  static inline uint8_t voxel_brick_get_attribute(voxel_brick brick, const int x, const int y, const int z) {
+    return brick->attributes ? brick->attributes[voxel_brick_index(x, y, z)] : 0;
   }
 
   static void voxel_brick_position(voxel_brick brick, const vec3 center) {
@@ -72,22 +628,134 @@
     brick->bounds_packet[5] = _mm_set1_ps(brick->bounds[1][2]);
   }
 
-  static inline float sign(const float a) {
-    return a < 0 ? -VOXEL_SIZE : VOXEL_SIZE;
+  // Integer DDA (Amanatides & Woo) in voxel coordinates. The only divides
+  // happen while setting up tDelta, every step is an integer increment. tMax
+  // is recomputed from the number of boundaries crossed rather than summed,
+  // so it depends on the voxel alone: skipping an empty cell, of any size,
+  // lands in the state single steps would have reached and every hierarchy
+  // walks the same voxels for a given ray, on any thread.
+  typedef struct {
+    int pos[3], step[3];
+    // boundaries crossed along each axis
+    int count[3];
+    float tmax[3], tdelta[3], slope[3];
+    // tmax before the first step
+    float tfirst[3];
+  } voxel_dda;
+
+  // where the ray crosses the next boundary of axis `k` after `count` of them
+  static inline float voxel_dda_tmax(const voxel_dda *dda, const int k, const int count) {
+    return dda->tfirst[k] + (float)count * dda->tdelta[k];
+  }
+
+  // `p` is the ray start relative to the volume's min corner in voxel units
+  static inline void voxel_dda_init(voxel_dda *dda, const vec3 p, const vec3 rd) {
+    for (int k=0; k<3; k++) {
+      // the entry point sits on the volume surface, keep it inside
+      int pos = (int)floorf(p[k]);
+      pos = pos < 0 ? 0 : (pos >= VOXEL_BRICK_WIDTH ? VOXEL_BRICK_WIDTH - 1 : pos);
+      dda->pos[k] = pos;
+      dda->count[k] = 0;
+      dda->slope[k] = fabsf(rd[k]);
+
+      if (rd[k] > 0.0f) {
+        dda->step[k] = 1;
+        dda->tdelta[k] = 1.0f / rd[k];
+        dda->tmax[k] = (pos + 1 - p[k]) * dda->tdelta[k];
+      } else if (rd[k] < 0.0f) {
+        dda->step[k] = -1;
+        dda->tdelta[k] = -1.0f / rd[k];
+        dda->tmax[k] = (p[k] - pos) * dda->tdelta[k];
+      } else {
+        dda->step[k] = 0;
+        dda->tdelta[k] = FLT_MAX;
+        dda->tmax[k] = FLT_MAX;
+      }
+      dda->tfirst[k] = dda->tmax[k];
+    }
   }
 
-  static inline float mod(const float value, const float modulus) {
-    return fmod(fmod(value, modulus) + modulus, modulus);
+  static inline int voxel_dda_inside(const voxel_dda *dda) {
+    return (
+      (unsigned int)dda->pos[0] < VOXEL_BRICK_WIDTH &&
+      (unsigned int)dda->pos[1] < VOXEL_BRICK_WIDTH &&
+      (unsigned int)dda->pos[2] < VOXEL_BRICK_WIDTH
+    );
   }
 
-  static inline float intbound(float s, float ds) {
-    if (ds < 0) {
-      s = -s;
-      ds = -ds;
+  // returns the axis that was stepped. on a tie the higher axis goes first
+  static inline int voxel_dda_step(voxel_dda *dda) {
+    // constant indices let the compiler keep the state in registers
+    if (dda->tmax[0] < dda->tmax[1]) {
+      if (dda->tmax[0] < dda->tmax[2]) {
+        dda->pos[0] += dda->step[0];
+        dda->tmax[0] = voxel_dda_tmax(dda, 0, ++dda->count[0]);
+        return 0;
+      }
+    } else if (dda->tmax[1] < dda->tmax[2]) {
+      dda->pos[1] += dda->step[1];
+      dda->tmax[1] = voxel_dda_tmax(dda, 1, ++dda->count[1]);
+      return 1;
     }
 
-    s = mod(s, VOXEL_SIZE);
-    return (VOXEL_SIZE-s)/ds;
+    dda->pos[2] += dda->step[2];
+    dda->tmax[2] = voxel_dda_tmax(dda, 2, ++dda->count[2]);
+    return 2;
+  }
+
+  // whether single steps would cross a boundary of an axis at `t` before
+  // the one at `texit`, `later` when the axis is above the one of `texit`
+  static inline int voxel_dda_before(const float t, const float texit, const int later) {
+    return t < texit || (t == texit && later);
+  }
+
+  // leave the empty, aligned (1 << shift)^3 cell around the current voxel
+  static inline void voxel_dda_skip(voxel_dda *dda, const int shift) {
+    // t where the ray leaves the empty cell along each axis
+    float texit = FLT_MAX;
+    int n[3], axis = 0;
+    for (int k=0; k<3; k++) {
+      if (!dda->step[k]) {
+        n[k] = 0;
+        continue;
+      }
+
+      n[k] = dda->step[k] > 0
+        ? (((dda->pos[k] >> shift) + 1) << shift) - dda->pos[k]
+        : dda->pos[k] - ((dda->pos[k] >> shift) << shift) + 1;
+
+      float t = voxel_dda_tmax(dda, k, dda->count[k] + n[k] - 1);
+      if (t <= texit) {
+        texit = t;
+        axis = k;
+      }
+    }
+
+    // jump every axis over the boundaries the ray crosses before texit. the
+    // estimate can be off by one either way, the exact tmax settles it
+    for (int k=0; k<3; k++) {
+      if (!dda->step[k]) {
+        continue;
+      }
+
+      int m = n[k];
+      if (k != axis) {
+        float estimate = (texit - dda->tmax[k]) * dda->slope[k];
+        m = estimate > 0.0f ? (int)estimate : 0;
+        if (m > 0 && !voxel_dda_before(voxel_dda_tmax(dda, k, dda->count[k] + m - 1), texit, k > axis)) {
+          m--;
+        }
+        if (voxel_dda_before(voxel_dda_tmax(dda, k, dda->count[k] + m), texit, k > axis)) {
+          m++;
+        }
+      }
+
+      if (m > 0) {
+        dda->pos[k] += m * dda->step[k];
+        dda->count[k] += m;
+        dda->tmax[k] = voxel_dda_tmax(dda, k, dda->count[k]);
+      }
+    }
   }
 
   // TODO: replace density with a callback?
@@ -98,77 +766,39 @@
     const float density,
     int *out
   ) {
+    voxel_dda dda;
+    voxel_dda_init(&dda, (isect - brick->bounds[0]) * vec3f(1.0f / VOXEL_SIZE), rd);
 
-    float rdx = rd[0] * VOXEL_SIZE;
-    float rdy = rd[1] * VOXEL_SIZE;
-    float rdz = rd[2] * VOXEL_SIZE;
-
-    float sx = sign(rdx);
-    float sy = sign(rdy);
-    float sz = sign(rdz);
-
-    float x = (isect[0] - brick->bounds[0][0]) + rdx;
-    float y = (isect[1] - brick->bounds[0][1]) + rdy;
-    float z = (isect[2] - brick->bounds[0][2]) + rdz;
-
-    float mx = intbound(x, rdx);
-    float my = intbound(y, rdy);
-    float mz = intbound(z, rdz);
-
-    float dx = sx/rdx;
-    float dy = sy/rdy;
-    float dz = sz/rdz;
-    int ix, iy, iz;
-
-    while (
-      x > 0 &&
-      y > 0 &&
-      z > 0 &&
-      x < VOXEL_BRICK_SIZE &&
-      y < VOXEL_BRICK_SIZE &&
-      z < VOXEL_BRICK_SIZE
-    ) {
-
-      ix = floor(x / VOXEL_SIZE);
-      iy = floor(y / VOXEL_SIZE);
-      iz = floor(z / VOXEL_SIZE);
-
-      if (voxel_brick_get(brick, ix, iy, iz) > density) {
-        out[0] = ix;
-        out[1] = iy;
-        out[2] = iz;
-        return 1;
-      }
-
-      if(mx < my) {
-        if(mx < mz) {
-          out[0] = -sx;
-          out[1] = out[2] = 0;
+    // the hierarchy is built against the brick threshold, so it is only
+    // conservative for queries at or above it
+    const int skip = brick->storage == VOXEL_BRICK_BITS || density >= brick->threshold;
+    int shift;
 
-          x += sx;
-          mx += dx;
-        } else {
-          out[2] = -sz;
-          out[0] = out[1] = 0;
+    // per axis index components, single steps update them in place so the
+    // walk never re-encodes the layout
+    unsigned int index[3];
+    for (int k=0; k<3; k++) {
+      index[k] = voxel_brick_axis(dda.pos[k], k);
+    }
 
-          z += sz;
-          mz += dz;
+    while (voxel_dda_inside(&dda)) {
+      if (skip && (shift = voxel_brick_empty_cell(brick, dda.pos[0], dda.pos[1], dda.pos[2]))) {
+        voxel_dda_skip(&dda, shift);
+        for (int k=0; k<3; k++) {
+          index[k] = voxel_brick_axis(dda.pos[k], k);
         }
-      } else {
-        if(my < mz) {
-          out[1] = -sy;
-          out[0] = out[2] = 0;
-
-          y += sy;
-          my += dy;
-        } else {
-          out[2] = -sz;
-          out[0] = out[1] = 0;
+        continue;
+      }
 
-          z += sz;
-          mz += dz;
-        }
+      if (voxel_brick_occupied_index(brick, index[0] | index[1] | index[2], density)) {
+        out[0] = dda.pos[0];
+        out[1] = dda.pos[1];
+        out[2] = dda.pos[2];
+        return 1;
       }
+
+      int axis = voxel_dda_step(&dda);
+      index[axis] = voxel_brick_axis_step(index[axis], axis, dda.step[axis]);
     }
     return 0;
   }
@@ -0,0 +1,569 @@
+#ifndef __WORLD__
+#define __WORLD__
+  #include <stdint.h>
+  #include <stdlib.h>
+  #include <float.h>
+  #include <limits.h>
+  #include "vec.h"
+  #include "aabb.h"
+  #include "voxel.h"
+  #include "voxel-packet.h"
+
+  // sparse grid of bricks keyed by integer brick coordinates. brick (0,0,0)
+  // is centered on the origin and every brick is VOXEL_BRICK_SIZE wide
+
+  typedef struct {
+    int x, y, z;
+    voxel_brick brick;
+  } voxel_world_slot;
+
+  typedef struct {
+    // open addressing hash table, an empty slot has a NULL brick
+    voxel_world_slot *slots;
+    unsigned int capacity;
+    unsigned int count;
+    // populated range in brick coordinates
+    int min[3], max[3];
+    aabb bounds;
+    aabb_packet bounds_packet;
+    // no ray from the eye a culled copy was made for (voxel_world_cull)
+    // meets anything closer than this, 0 for the world itself
+    float depth;
+  } *voxel_world, voxel_world_t;
+
+  typedef struct {
+    voxel_brick brick;
+    // point where the ray entered `brick`
+    vec3 entry;
+    int voxel[3];
+  } voxel_world_hit;
+
+  static inline unsigned int voxel_world_hash(const int x, const int y, const int z) {
+    return ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u);
+  }
+
+  static voxel_world voxel_world_create() {
+    voxel_world out = (voxel_world)malloc(sizeof(voxel_world_t));
+    out->capacity = 64;
+    out->count = 0;
+    out->slots = (voxel_world_slot *)calloc(out->capacity, sizeof(voxel_world_slot));
+    for (int k=0; k<3; k++) {
+      out->min[k] = INT_MAX;
+      out->max[k] = INT_MIN;
+    }
+    out->bounds[0] = vec3f(0.0f);
+    out->bounds[1] = vec3f(0.0f);
+    out->depth = 0.0f;
+    return out;
+  }
+
+  static voxel_world_slot *voxel_world_slot_find(voxel_world world, const int x, const int y, const int z) {
+    unsigned int mask = world->capacity - 1;
+    unsigned int i = voxel_world_hash(x, y, z) & mask;
+
+    for (;;) {
+      voxel_world_slot *slot = &world->slots[i];
+      if (!slot->brick || (slot->x == x && slot->y == y && slot->z == z)) {
+        return slot;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  static inline voxel_brick voxel_world_get(voxel_world world, const int x, const int y, const int z) {
+    return voxel_world_slot_find(world, x, y, z)->brick;
+  }
+
+  static void voxel_world_grow(voxel_world world) {
+    voxel_world_slot *old = world->slots;
+    unsigned int capacity = world->capacity;
+
+    world->capacity *= 2;
+    world->slots = (voxel_world_slot *)calloc(world->capacity, sizeof(voxel_world_slot));
+
+    for (unsigned int i=0; i<capacity; i++) {
+      if (old[i].brick) {
+        *voxel_world_slot_find(world, old[i].x, old[i].y, old[i].z) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  // world space box of the populated range
+  static void voxel_world_bounds(voxel_world world) {
+    world->bounds[0] = vec3_create(world->min[0], world->min[1], world->min[2]) * vec3f(VOXEL_BRICK_SIZE) - vec3f(VOXEL_BRICK_HALF_SIZE);
+    world->bounds[1] = vec3_create(world->max[0], world->max[1], world->max[2]) * vec3f(VOXEL_BRICK_SIZE) + vec3f(VOXEL_BRICK_HALF_SIZE);
+    for (int k=0; k<3; k++) {
+      world->bounds_packet[k] = _mm_set1_ps(world->bounds[0][k]);
+      world->bounds_packet[k + 3] = _mm_set1_ps(world->bounds[1][k]);
+    }
+  }
+
+  // place `brick` at brick coordinates `x,y,z`, repositioning it in space.
+  // returns the brick it replaces (NULL when the cell was empty), which the
+  // world no longer owns, like voxel_world_remove
+  static voxel_brick voxel_world_set(voxel_world world, const int x, const int y, const int z, voxel_brick brick) {
+    if ((world->count + 1) * 2 > world->capacity) {
+      voxel_world_grow(world);
+    }
+
+    voxel_world_slot *slot = voxel_world_slot_find(world, x, y, z);
+    voxel_brick out = slot->brick;
+    if (!out) {
+      world->count++;
+    }
+
+    slot->x = x;
+    slot->y = y;
+    slot->z = z;
+    slot->brick = brick;
+    voxel_brick_position(brick, vec3_create(x, y, z) * vec3f(VOXEL_BRICK_SIZE));
+
+    const int p[3] = { x, y, z };
+    for (int k=0; k<3; k++) {
+      world->min[k] = p[k] < world->min[k] ? p[k] : world->min[k];
+      world->max[k] = p[k] > world->max[k] ? p[k] : world->max[k];
+    }
+    voxel_world_bounds(world);
+    return out;
+  }
+
+  // takes the brick at `x,y,z` out of the world and returns it (NULL when
+  // there is none). the populated range is not shrunk, it stays a
+  // conservative bound for the walk
+  static voxel_brick voxel_world_remove(voxel_world world, const int x, const int y, const int z) {
+    voxel_world_slot *slot = voxel_world_slot_find(world, x, y, z);
+    voxel_brick out = slot->brick;
+    if (!out) {
+      return NULL;
+    }
+
+    // backward shift deletion keeps every probe chain unbroken
+    unsigned int mask = world->capacity - 1;
+    unsigned int hole = slot - world->slots;
+    for (unsigned int i = (hole + 1) & mask; world->slots[i].brick; i = (i + 1) & mask) {
+      voxel_world_slot *next = &world->slots[i];
+      unsigned int home = voxel_world_hash(next->x, next->y, next->z) & mask;
+      // move it back unless its home lies cyclically in (hole, i]
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        world->slots[hole] = *next;
+        hole = i;
+      }
+    }
+
+    world->slots[hole].brick = NULL;
+    world->count--;
+    return out;
+  }
+
+  // destroys the world along with every brick in it
+  static void voxel_world_destroy(voxel_world world) {
+    for (unsigned int i=0; i<world->capacity; i++) {
+      if (world->slots[i].brick) {
+        voxel_brick_destroy(world->slots[i].brick);
+      }
+    }
+    free(world->slots);
+    free(world);
+  }
+
+  // move every brick to numa `node`, or interleave them when `node` < 0
+  static void voxel_world_place(voxel_world world, const int node) {
+    for (unsigned int i=0; i<world->capacity; i++) {
+      if (world->slots[i].brick) {
+        voxel_brick_place(world->slots[i].brick, node);
+      }
+    }
+  }
+
+  // copy of `world` whose table and bricks all live on numa `node`
+  static voxel_world voxel_world_clone(voxel_world world, const int node) {
+    voxel_world out = (voxel_world)numa_alloc(sizeof(voxel_world_t), node);
+    *out = *world;
+    out->slots = (voxel_world_slot *)numa_alloc(sizeof(voxel_world_slot) * world->capacity, node);
+    for (unsigned int i=0; i<world->capacity; i++) {
+      out->slots[i] = world->slots[i];
+      if (world->slots[i].brick) {
+        out->slots[i].brick = voxel_brick_clone(world->slots[i].brick, node);
+      }
+    }
+    return out;
+  }
+
+  // the rays of a screen tile all lie inside the pyramid spanned by its 4
+  // corner rays, bounded by 4 planes through the eye. a box entirely on the
+  // outer side of one of them can not be hit by any ray of the tile
+
+  typedef struct {
+    vec3 origin;
+    // pointing into the beam
+    vec3 normal[4];
+  } voxel_world_beam;
+
+  // slots (indices into a world's table) of the bricks a beam may touch.
+  // built once per frame from the whole screen's beam, every tile then
+  // culls from it instead of scanning the table. a clone (see
+  // voxel_world_clone) keeps the table layout, so it shares the list
+  typedef struct {
+    unsigned int *slots;
+    unsigned int count, capacity;
+  } voxel_world_list;
+
+  // `corners` are the corner directions in order around the beam
+  static void voxel_world_beam_create(voxel_world_beam *beam, const vec3 ro, const vec3 *corners) {
+    vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+    beam->origin = ro;
+    for (int i=0; i<4; i++) {
+      vec3 a = corners[i], b = corners[(i + 1) & 3];
+      vec3 n = vec3_create(
+        a[1] * b[2] - a[2] * b[1],
+        a[2] * b[0] - a[0] * b[2],
+        a[0] * b[1] - a[1] * b[0]
+      );
+      float d = n[0] * center[0] + n[1] * center[1] + n[2] * center[2];
+      beam->normal[i] = d < 0.0f ? -n : n;
+    }
+  }
+
+  // conservative, 0 only when no ray of the beam can touch `box`
+  static int voxel_world_beam_overlap(const voxel_world_beam *beam, const aabb box) {
+    for (int i=0; i<4; i++) {
+      const vec3 n = beam->normal[i];
+      float d = 0.0f;
+      // the corner of the box furthest along the normal
+      for (int k=0; k<3; k++) {
+        d += n[k] * ((n[k] > 0.0f ? box[1][k] : box[0][k]) - beam->origin[k]);
+      }
+
+      if (d < 0.0f) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  // squared distance from `p` to the closest point of `box`
+  static inline float voxel_world_box_distance2(const vec3 p, const aabb box) {
+    float d2 = 0.0f;
+    for (int k=0; k<3; k++) {
+      float d = box[0][k] - p[k];
+      d = p[k] - box[1][k] > d ? p[k] - box[1][k] : d;
+      d2 += d > 0.0f ? d * d : 0.0f;
+    }
+    return d2;
+  }
+
+  // squared distance from the beam's eye to the closest coarse (L2) cell of
+  // `brick` that may hold a voxel and lies inside the beam. only bit
+  // bricks have cells valid for every density, float ones use their bounds
+  static float voxel_world_brick_distance2(const voxel_world_beam *beam, voxel_brick brick) {
+    if (brick->storage != VOXEL_BRICK_BITS) {
+      return voxel_world_box_distance2(beam->origin, brick->bounds);
+    }
+
+    const float size = (1 << VOXEL_CELL_L2_SHIFT) * VOXEL_SIZE;
+    float best = FLT_MAX;
+    for (uint64_t cells = brick->cells_l2; cells; cells &= cells - 1) {
+      int c = __builtin_ctzll(cells);
+      vec3 lo = brick->bounds[0] + vec3_create(
+        c / (VOXEL_CELL_L2_WIDTH * VOXEL_CELL_L2_WIDTH),
+        (c / VOXEL_CELL_L2_WIDTH) % VOXEL_CELL_L2_WIDTH,
+        c % VOXEL_CELL_L2_WIDTH
+      ) * vec3f(size);
+      aabb cell = { lo, lo + vec3f(size) };
+      if (!voxel_world_beam_overlap(beam, cell)) {
+        continue;
+      }
+
+      float d2 = voxel_world_box_distance2(beam->origin, cell);
+      best = d2 < best ? d2 : best;
+    }
+    return best;
+  }
+
+  // fills `list` with the bricks of `world` inside `beam`
+  static void voxel_world_list_build(voxel_world world, const voxel_world_beam *beam, voxel_world_list *list) {
+    list->count = 0;
+    if (!world->count || !voxel_world_beam_overlap(beam, world->bounds)) {
+      return;
+    }
+
+    if (list->capacity < world->count) {
+      free(list->slots);
+      list->capacity = world->count;
+      list->slots = (unsigned int *)malloc(sizeof(unsigned int) * list->capacity);
+    }
+
+    for (unsigned int i=0; i<world->capacity; i++) {
+      voxel_brick brick = world->slots[i].brick;
+      if (brick && voxel_world_beam_overlap(beam, brick->bounds)) {
+        list->slots[list->count++] = i;
+      }
+    }
+  }
+
+  static void voxel_world_list_destroy(voxel_world_list *list) {
+    free(list->slots);
+    list->slots = NULL;
+    list->count = 0;
+    list->capacity = 0;
+  }
+
+  // narrows `out`, a copy of `world`'s header sharing its table, to the
+  // bricks of `list` inside `beam` so walks through it start and stop at
+  // them. its depth is the distance to the nearest cell those bricks may
+  // fill, every ray of the beam walks the empty prefix up to there without
+  // lookups. returns how many bricks are visible, 0 means the walk can be
+  // skipped
+  static int voxel_world_cull(voxel_world world, const voxel_world_list *list, const voxel_world_beam *beam, voxel_world_t *out) {
+    *out = *world;
+    if (!list->count || !voxel_world_beam_overlap(beam, world->bounds)) {
+      return 0;
+    }
+
+    int visible = 0;
+    float depth2 = FLT_MAX;
+    for (int k=0; k<3; k++) {
+      out->min[k] = INT_MAX;
+      out->max[k] = INT_MIN;
+    }
+
+    for (unsigned int i=0; i<list->count; i++) {
+      voxel_world_slot *slot = &world->slots[list->slots[i]];
+      if (!voxel_world_beam_overlap(beam, slot->brick->bounds)) {
+        continue;
+      }
+
+      const int p[3] = { slot->x, slot->y, slot->z };
+      for (int k=0; k<3; k++) {
+        out->min[k] = p[k] < out->min[k] ? p[k] : out->min[k];
+        out->max[k] = p[k] > out->max[k] ? p[k] : out->max[k];
+      }
+      visible++;
+
+      float d2 = voxel_world_brick_distance2(beam, slot->brick);
+      depth2 = d2 < depth2 ? d2 : depth2;
+    }
+
+    if (visible) {
+      voxel_world_bounds(out);
+      // a voxel's width of slack for rounding in the walk
+      float depth = depth2 < FLT_MAX ? sqrtf(depth2) - VOXEL_SIZE : 0.0f;
+      out->depth = depth > world->depth ? depth : world->depth;
+    }
+    return visible;
+  }
+
+  // DDA state for one ray walking the brick grid
+  typedef struct {
+    int cell[3], step[3];
+    float tmax[3], tdelta[3];
+    // distance along the ray where the current cell was entered
+    float t;
+  } voxel_world_walk;
+
+  // sets `w` up to walk `ro + rd*t` from `tmin` on, where the ray is inside
+  // the world's bounds (up to rounding, the cell is clamped into them)
+  static inline void voxel_world_walk_start(voxel_world world, voxel_world_walk *w, const vec3 ro, const vec3 rd, const float tmin) {
+    w->t = tmin;
+    for (int k=0; k<3; k++) {
+      // brick relative position in brick units
+      float p = (ro[k] + rd[k] * tmin) / VOXEL_BRICK_SIZE + 0.5f;
+      int c = (int)floorf(p);
+      c = c < world->min[k] ? world->min[k] : (c > world->max[k] ? world->max[k] : c);
+      w->cell[k] = c;
+
+      if (rd[k] > 0.0f) {
+        w->step[k] = 1;
+        w->tdelta[k] = VOXEL_BRICK_SIZE / rd[k];
+        w->tmax[k] = tmin + (c + 1 - p) * w->tdelta[k];
+      } else if (rd[k] < 0.0f) {
+        w->step[k] = -1;
+        w->tdelta[k] = -VOXEL_BRICK_SIZE / rd[k];
+        w->tmax[k] = tmin + (p - c) * w->tdelta[k];
+      } else {
+        w->step[k] = 0;
+        w->tdelta[k] = FLT_MAX;
+        w->tmax[k] = FLT_MAX;
+      }
+    }
+  }
+
+  // returns 0 when `ro + rd*t` misses the populated area of the world
+  static int voxel_world_walk_init(voxel_world world, voxel_world_walk *w, const vec3 ro, const vec3 rd) {
+    float tmin = 0.0f, tmax = FLT_MAX;
+
+    for (int k=0; k<3; k++) {
+      if (rd[k] == 0.0f) {
+        if (ro[k] < world->bounds[0][k] || ro[k] > world->bounds[1][k]) {
+          return 0;
+        }
+        continue;
+      }
+
+      float inv = 1.0f / rd[k];
+      float t1 = (world->bounds[0][k] - ro[k]) * inv;
+      float t2 = (world->bounds[1][k] - ro[k]) * inv;
+      // plain compares, fminf/fmaxf are libm calls without -ffast-math
+      float near = t1 < t2 ? t1 : t2;
+      float far = t1 < t2 ? t2 : t1;
+      tmin = near > tmin ? near : tmin;
+      tmax = far < tmax ? far : tmax;
+    }
+
+    if (!world->count || tmax < tmin) {
+      return 0;
+    }
+
+    voxel_world_walk_start(world, w, ro, rd, tmin);
+    return 1;
+  }
+
+  // move to the next brick cell, returns 0 once the walk leaves the world
+  static inline int voxel_world_walk_step(voxel_world world, voxel_world_walk *w) {
+    int axis;
+    if (w->tmax[0] < w->tmax[1]) {
+      axis = w->tmax[0] < w->tmax[2] ? 0 : 2;
+    } else {
+      axis = w->tmax[1] < w->tmax[2] ? 1 : 2;
+    }
+
+    w->t = w->tmax[axis];
+    w->cell[axis] += w->step[axis];
+    w->tmax[axis] += w->tdelta[axis];
+    return w->cell[axis] >= world->min[axis] && w->cell[axis] <= world->max[axis];
+  }
+
+  // step over the cells the ray leaves before `depth` without looking them
+  // up, returns 0 once the walk leaves the world
+  static inline int voxel_world_walk_skip(voxel_world world, voxel_world_walk *w, const float depth) {
+    for (;;) {
+      float exit = w->tmax[0] < w->tmax[1] ? w->tmax[0] : w->tmax[1];
+      exit = w->tmax[2] < exit ? w->tmax[2] : exit;
+      if (exit >= depth) {
+        return 1;
+      }
+
+      if (!voxel_world_walk_step(world, w)) {
+        return 0;
+      }
+    }
+  }
+
+  // walk the brick grid and descend into populated bricks only. `rd` must be
+  // normalized
+  static int voxel_world_traverse(
+    voxel_world world,
+    const vec3 ro,
+    const vec3 rd,
+    const float density,
+    voxel_world_hit *hit
+  ) {
+    voxel_world_walk w;
+    if (!voxel_world_walk_init(world, &w, ro, rd) || !voxel_world_walk_skip(world, &w, world->depth)) {
+      return 0;
+    }
+
+    do {
+      voxel_brick brick = voxel_world_get(world, w.cell[0], w.cell[1], w.cell[2]);
+      if (!brick) {
+        continue;
+      }
+
+      vec3 entry = ro + rd * vec3f(w.t);
+      if (voxel_brick_traverse(brick, entry, rd, density, hit->voxel)) {
+        hit->brick = brick;
+        hit->entry = entry;
+        return 1;
+      }
+    } while (voxel_world_walk_step(world, &w));
+
+    return 0;
+  }
+
+  // `w` rays walk the brick grid in lock step. lanes that sit in the same
+  // populated brick are traversed together with voxel_brick_traverse_packet##w.
+  // the caller already tested the lanes of `mask` against the world's
+  // bounds, `tstart` is where each of them enters (0 from inside). always
+  // inlined, so every render_screen_area variant (render.h) gets a copy
+  // built for its instruction set
+  #define VOXEL_WORLD_PACKET_DEFINE(w) \
+  static inline __attribute__((always_inline)) int voxel_world_traverse_packet##w( \
+    voxel_world world, \
+    int mask, \
+    const vec3 ro, \
+    const vec3 *rd, \
+    const float *tstart, \
+    const float density, \
+    voxel_world_hit *hits \
+  ) { \
+    voxel_world_walk walk[w]; \
+    voxel_brick bricks[w]; \
+    vec3 entry[w]; \
+    int voxel_pos[w*3]; \
+    int found = 0; \
+    \
+    for (int j=0; j<w; j++) { \
+      if (!(mask & (1<<j))) { \
+        continue; \
+      } \
+      \
+      voxel_world_walk_start(world, &walk[j], ro, rd[j], tstart[j]); \
+      if (!voxel_world_walk_skip(world, &walk[j], world->depth)) { \
+        mask &= ~(1<<j); \
+      } \
+    } \
+    \
+    while (mask) { \
+      for (int j=0; j<w; j++) { \
+        if (mask & (1<<j)) { \
+          bricks[j] = voxel_world_get(world, walk[j].cell[0], walk[j].cell[1], walk[j].cell[2]); \
+          entry[j] = ro + rd[j] * vec3f(walk[j].t); \
+        } else { \
+          bricks[j] = NULL; \
+        } \
+      } \
+      \
+      for (int j=0; j<w; j++) { \
+        if (!bricks[j]) { \
+          continue; \
+        } \
+        \
+        voxel_brick brick = bricks[j]; \
+        int lanes = 0; \
+        for (int i=j; i<w; i++) { \
+          if (bricks[i] == brick) { \
+            lanes |= 1<<i; \
+            bricks[i] = NULL; \
+          } \
+        } \
+        \
+        int result = voxel_brick_traverse_packet##w(brick, lanes, entry, rd, density, voxel_pos); \
+        for (int i=0; i<w; i++) { \
+          if (result & (1<<i)) { \
+            hits[i].brick = brick; \
+            hits[i].entry = entry[i]; \
+            hits[i].voxel[0] = voxel_pos[i*3 + 0]; \
+            hits[i].voxel[1] = voxel_pos[i*3 + 1]; \
+            hits[i].voxel[2] = voxel_pos[i*3 + 2]; \
+          } \
+        } \
+        \
+        found |= result; \
+        mask &= ~result; \
+      } \
+      \
+      for (int j=0; j<w; j++) { \
+        if ((mask & (1<<j)) && !voxel_world_walk_step(world, &walk[j])) { \
+          mask &= ~(1<<j); \
+        } \
+      } \
+    } \
+    \
+    return found; \
+  }
+
+  VOXEL_WORLD_PACKET_DEFINE(4)
+  // only called from the avx2 and avx512 render variants
+  VOXEL_WORLD_PACKET_DEFINE(8)
+#endif
@@ -0,0 +1,230 @@
+#ifndef __WRITER__
+#define __WRITER__
+  #include <stdio.h>
+  #include <stdlib.h>
+  #include <stdint.h>
+  #include <string.h>
+  #include <pthread.h>
+  #include "mem.h"
+
+  // writes rendered frames to disk (or stdout) from its own thread so the
+  // renderer never waits on the file system. frames go through a small
+  // ring of buffers, the renderer only blocks when every one of them is
+  // still queued for writing:
+  //
+  //   uint8_t *data = writer_acquire(w);
+  //   ... render width * height * stride bytes into data ...
+  //   writer_submit(w, frame);
+  //
+  // `path` is "-" for stdout, a printf pattern with one integer (like
+  // "frame-%04i.ppm", %% for a literal percent sign) for a file per frame,
+  // or a single file every frame is appended to. concatenated ppm images and raw frames are what
+  // `ffmpeg -f image2pipe` and `ffmpeg -f rawvideo` read
+
+  #define WRITER_BUFFERS 3
+
+  // binary ppm (P6), RGB only, the alpha of RGBA frames is dropped
+  #define WRITER_PPM 0
+  // the frame as rendered, width * height * stride bytes with no header
+  #define WRITER_RAW 1
+
+  typedef struct {
+    const char *path;
+    int per_frame;
+    // shared stream when every frame goes to the same place
+    FILE *stream;
+    int format;
+    int width, height, stride;
+    uint8_t *buffers[WRITER_BUFFERS];
+    int frames[WRITER_BUFFERS];
+    // oldest queued buffer and how many are queued, the one being written
+    // included
+    int head, queued;
+    int closing;
+    // frames that could not be written
+    int failed;
+    // packed RGB row for ppm output of RGBA frames
+    uint8_t *row;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, drained;
+    pthread_t thread;
+  } *writer, writer_t;
+
+  static int writer_frame(writer w, FILE *f, const uint8_t *data) {
+    const size_t row = (size_t)w->width * w->stride;
+    if (w->format == WRITER_RAW) {
+      return fwrite(data, row, w->height, f) == (size_t)w->height;
+    }
+
+    if (fprintf(f, "P6\n%i %i\n255\n", w->width, w->height) < 0) {
+      return 0;
+    }
+
+    if (w->stride == 3) {
+      return fwrite(data, row, w->height, f) == (size_t)w->height;
+    }
+
+    for (int y=0; y<w->height; y++) {
+      const uint8_t *src = data + y * row;
+      for (int x=0; x<w->width; x++) {
+        w->row[x * 3 + 0] = src[x * 4 + 0];
+        w->row[x * 3 + 1] = src[x * 4 + 1];
+        w->row[x * 3 + 2] = src[x * 4 + 2];
+      }
+
+      if (fwrite(w->row, w->width * 3, 1, f) != 1) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  static void *writer_run(void *arg) {
+    writer w = (writer)arg;
+    char path[4096];
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+      while (!w->queued && !w->closing) {
+        pthread_cond_wait(&w->ready, &w->lock);
+      }
+
+      if (!w->queued) {
+        break;
+      }
+
+      // the buffer stays queued while it is written, so it is not handed
+      // out again
+      int index = w->head;
+      pthread_mutex_unlock(&w->lock);
+
+      int ok = 0;
+      if (w->per_frame) {
+        snprintf(path, sizeof(path), w->path, w->frames[index]);
+        FILE *f = fopen(path, "wb");
+        if (f) {
+          ok = writer_frame(w, f, w->buffers[index]);
+          ok = !fclose(f) && ok;
+        }
+      } else {
+        ok = writer_frame(w, w->stream, w->buffers[index]) && !fflush(w->stream);
+      }
+
+      if (!ok) {
+        fprintf(stderr, "could not write frame %i to %s\n", w->frames[index], w->per_frame ? path : w->path);
+      }
+
+      pthread_mutex_lock(&w->lock);
+      w->failed += !ok;
+      w->head = (w->head + 1) % WRITER_BUFFERS;
+      w->queued--;
+      pthread_cond_signal(&w->drained);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+  }
+
+  // how many integer conversions (%d or %i, with optional flags and width)
+  // a per frame pattern has, -1 when it has any other conversion. the
+  // pattern goes to snprintf with a single int, so nothing else is safe
+  static int writer_pattern(const char *path) {
+    int count = 0;
+    for (const char *c = path; *c; c++) {
+      if (*c != '%') {
+        continue;
+      }
+
+      if (*++c == '%') {
+        continue;
+      }
+
+      c += strspn(c, "-+ #0");
+      c += strspn(c, "0123456789");
+      if (*c != 'd' && *c != 'i') {
+        return -1;
+      }
+      count++;
+    }
+    return count;
+  }
+
+  // NULL when the output can not be opened
+  static writer writer_create(const char *path, const int format, const int width, const int height, const int stride) {
+    writer w = (writer)calloc(1, sizeof(writer_t));
+    w->path = path;
+    w->format = format;
+    w->width = width;
+    w->height = height;
+    w->stride = stride;
+
+    if (!strcmp(path, "-")) {
+      w->stream = stdout;
+    } else if (strchr(path, '%')) {
+      if (writer_pattern(path) != 1) {
+        fprintf(stderr, "%s needs exactly one %%d or %%i and no other conversion\n", path);
+        free(w);
+        return NULL;
+      }
+      w->per_frame = 1;
+    } else if (!(w->stream = fopen(path, "wb"))) {
+      fprintf(stderr, "could not open %s\n", path);
+      free(w);
+      return NULL;
+    }
+
+    for (int i=0; i<WRITER_BUFFERS; i++) {
+      w->buffers[i] = (uint8_t *)mem_alloc((size_t)width * height * stride);
+    }
+    w->row = (uint8_t *)malloc((size_t)width * 3);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->drained, NULL);
+    pthread_create(&w->thread, NULL, writer_run, w);
+    return w;
+  }
+
+  // buffer for the next frame, waits while every buffer is queued
+  static uint8_t *writer_acquire(writer w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->queued == WRITER_BUFFERS) {
+      pthread_cond_wait(&w->drained, &w->lock);
+    }
+    uint8_t *out = w->buffers[(w->head + w->queued) % WRITER_BUFFERS];
+    pthread_mutex_unlock(&w->lock);
+    return out;
+  }
+
+  // queue the buffer returned by the last writer_acquire
+  static void writer_submit(writer w, const int frame) {
+    pthread_mutex_lock(&w->lock);
+    w->frames[(w->head + w->queued) % WRITER_BUFFERS] = frame;
+    w->queued++;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  // writes whatever is still queued, returns how many frames failed
+  static int writer_destroy(writer w) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    int failed = w->failed;
+    if (w->stream && w->stream != stdout && fclose(w->stream)) {
+      failed++;
+    }
+
+    for (int i=0; i<WRITER_BUFFERS; i++) {
+      mem_free(w->buffers[i], (size_t)w->width * w->height * w->stride);
+    }
+    free(w->row);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->ready);
+    pthread_cond_destroy(&w->drained);
+    free(w);
+    return failed;
+  }
+#endif